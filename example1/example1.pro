@@ -2,3 +2,5 @@
 SOURCES += \
 		../hst/hst.c \
 		main.c
+
+LIBS += -lpthread
@@ -10,9 +10,9 @@
 
 // forward declarations
 static void prepare_templates(void);
-static void tfunc_req_number(void);
-static void tfunc_uptime(void);
-static void tfunc_show_headers(void);
+static void tfunc_req_number(hst_ctx_t *hst);
+static void tfunc_uptime(hst_ctx_t *hst);
+static void tfunc_show_headers(hst_ctx_t *hst);
 static void request_get(void);
 static void get_root(void);
 
@@ -26,6 +26,10 @@ static struct {
 } srv;
 
 
+// library instance
+static hst_ctx_t *hst;
+
+
 // request context
 static struct {
     hst_req_t *req;
@@ -50,8 +54,8 @@ int main() {
     conf.addr = INADDR_ANY;
     conf.port = htons(30000);
     conf.mem_total = 10000;
-    res = hst_init(&conf);
-    if (res != HST_RES_OK) {
+    hst = hst_init(&conf);
+    if (hst == NULL) {
         ERROR("Hst is not initialised.");
         goto exit;
     }
@@ -63,7 +67,7 @@ int main() {
     for (;;) {
         memset(&ctx, 0, sizeof(ctx));
 
-        res = hst_read(&ctx.req);
+        res = hst_read(hst, &ctx.req);
         if (res == HST_RES_CONT) {
             continue;
         } else if (res == HST_RES_ERR) {
@@ -78,10 +82,10 @@ int main() {
 
         if (ctx.req->method_get) {
             if (ctx.path && 0 == strcmp(ctx.path->name, "exit")) {
-                hst_write_res(200, "Ok");
-                hst_write_hdr("Content-Type", "text/plain");
-                hst_write_body_print("HST server shutdown.");
-                hst_write_end();
+                hst_write_res(hst, 200, "Ok");
+                hst_write_hdr(hst, "Content-Type", "text/plain");
+                hst_write_body_print(hst, "HST server shutdown.");
+                hst_write_end(hst);
                 break;
             }
             request_get();
@@ -94,14 +98,14 @@ int main() {
         if (ctx.req_handled) {
             srv.req_count++;
         } else {
-            hst_write_res(404, "Not found");
-            hst_write_hdr("Content-Type", "text/plain");
-            hst_write_body_print("Page not found.");
-            hst_write_end();
+            hst_write_res(hst, 404, "Not found");
+            hst_write_hdr(hst, "Content-Type", "text/plain");
+            hst_write_body_print(hst, "Page not found.");
+            hst_write_end(hst);
         }
     }
 
-    hst_deinit();
+    hst_deinit(hst);
     printf("Hst deinitialised.\n");
 
 exit:
@@ -120,14 +124,14 @@ static void request_get(void) {
 static void prepare_templates(void) {
     int res;
 
-    res = hst_tpl_function("req_number", tfunc_req_number);
+    res = hst_tpl_function(hst, "req_number", tfunc_req_number);
     if (res != HST_RES_OK) goto efunc;
-    res = hst_tpl_function("uptime", tfunc_uptime);
+    res = hst_tpl_function(hst, "uptime", tfunc_uptime);
     if (res != HST_RES_OK) goto efunc;
-    res = hst_tpl_function("show_headers", tfunc_show_headers);
+    res = hst_tpl_function(hst, "show_headers", tfunc_show_headers);
     if (res != HST_RES_OK) goto efunc;
 
-    tpl_main = hst_tpl_compile(
+    tpl_main = hst_tpl_compile(hst,
 "<!DOCTYPE html>\r\n"
 "<html>\r\n"
 "<head>\r\n"
@@ -154,32 +158,32 @@ etpl:
 }
 
 
-static void tfunc_req_number(void) {
-    hst_write_body_printf("%d", srv.req_count+1);
+static void tfunc_req_number(hst_ctx_t *hst) {
+    hst_write_body_printf(hst, "%d", srv.req_count+1);
 }
 
 
-static void tfunc_uptime(void) {
+static void tfunc_uptime(hst_ctx_t *hst) {
     time_t time_now = time(NULL);
     time_t time_passed = time_now - srv.time_start;
     struct tm tm_time = *gmtime(&time_passed);
     char buf[100];
     strftime(buf, sizeof(buf), "%T", &tm_time);
-    hst_write_body_printf("%s", buf);
+    hst_write_body_printf(hst, "%s", buf);
 }
 
 
 
-static void tfunc_show_headers(void) {
+static void tfunc_show_headers(hst_ctx_t *hst) {
     hst_hdr_t *hdr = ctx.req->hdr_first;
     for (; hdr; hdr = hdr->next) {
-        hst_write_body_printf("<p>%s: %s</p>\r\n", hdr->name, hdr->value);
+        hst_write_body_printf(hst, "<p>%s: %s</p>\r\n", hdr->name, hdr->value);
     }
 }
 
 
 static void get_root(void) {
-    hst_write_res(200, "Ok");
-    hst_write_tpl(tpl_main);
+    hst_write_res(hst, 200, "Ok");
+    hst_write_tpl(hst, tpl_main);
     ctx.req_handled = true;
 }
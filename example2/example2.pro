@@ -6,3 +6,5 @@ SOURCES += \
     main.c \
     _web.c \
     ../hst/hst.c
+
+LIBS += -lpthread
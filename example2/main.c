@@ -5,10 +5,14 @@
 #include "_web.h"
 
 
+#define ERROR(fmt, ...) fprintf(stderr, \
+        "ERROR: %s():%d: " fmt "\n", __func__, __LINE__, ##__VA_ARGS__)
+
+
 // forward declarations
 static void prepare_templates(void);
-static void tfunc_req_number(void);
-static void tfunc_uptime(void);
+static void tfunc_req_number(hst_ctx_t *hst);
+static void tfunc_uptime(hst_ctx_t *hst);
 static void request_get(void);
 static void get_root(void);
 
@@ -22,6 +26,10 @@ static struct {
 } srv;
 
 
+// library instance
+static hst_ctx_t *hst;
+
+
 // request context
 static struct {
     hst_req_t *req;
@@ -46,8 +54,8 @@ int main() {
     conf.addr = INADDR_ANY;
     conf.port = htons(30000);
     conf.mem_total = 10000;
-    res = hst_init(&conf);
-    if (res != HST_RES_OK) {
+    hst = hst_init(&conf);
+    if (hst == NULL) {
         ERROR("Hst is not initialised.");
         goto exit;
     }
@@ -59,11 +67,8 @@ int main() {
     for (;;) {
         memset(&ctx, 0, sizeof(ctx));
 
-        res = hst_read(&ctx.req);
-        if (res == HST_RES_TIMEOUT) {
-            continue;
-        } else if (res == HST_RES_BADREQUEST) {
-            printf("Bad request.\n");
+        res = hst_read(hst, &ctx.req);
+        if (res == HST_RES_CONT) {
             continue;
         } else if (res == HST_RES_ERR) {
             printf("Got error.\n");
@@ -86,14 +91,14 @@ int main() {
         if (ctx.req_handled) {
             srv.req_count++;
         } else {
-            hst_write_res(404, "Not found");
-            hst_write_hdr("Content-Type", "text/plain");
-            hst_write_body_print("Page not found.");
-            hst_write_end();
+            hst_write_res(hst, 404, "Not found");
+            hst_write_hdr(hst, "Content-Type", "text/plain");
+            hst_write_body_print(hst, "Page not found.");
+            hst_write_end(hst);
         }
     }
 
-    hst_deinit();
+    hst_deinit(hst);
     printf("Hst deinitialised.\n");
 
 exit:
@@ -112,12 +117,12 @@ static void request_get(void) {
 static void prepare_templates(void) {
     int res;
 
-    res = hst_tpl_function("req_number", tfunc_req_number);
+    res = hst_tpl_function(hst, "req_number", tfunc_req_number);
     if (res != HST_RES_OK) goto efunc;
-    res = hst_tpl_function("uptime", tfunc_uptime);
+    res = hst_tpl_function(hst, "uptime", tfunc_uptime);
     if (res != HST_RES_OK) goto efunc;
 
-    tpl_main = hst_tpl_compile(html_test);
+    tpl_main = hst_tpl_compile(hst, html_test);
     if (tpl_main == NULL) goto etpl;
 
     return;
@@ -131,23 +136,23 @@ etpl:
 }
 
 
-static void tfunc_req_number(void) {
-    hst_write_body_printf("%d", srv.req_count+1);
+static void tfunc_req_number(hst_ctx_t *hst) {
+    hst_write_body_printf(hst, "%d", srv.req_count+1);
 }
 
 
-static void tfunc_uptime(void) {
+static void tfunc_uptime(hst_ctx_t *hst) {
     time_t time_now = time(NULL);
     time_t time_passed = time_now - srv.time_start;
     struct tm tm_time = *gmtime(&time_passed);
     char buf[100];
     strftime(buf, sizeof(buf), "%T", &tm_time);
-    hst_write_body_printf("%s", buf);
+    hst_write_body_printf(hst, "%s", buf);
 }
 
 
 static void get_root(void) {
-    hst_write_res(200, "Ok");
-    hst_write_tpl(tpl_main);
+    hst_write_res(hst, 200, "Ok");
+    hst_write_tpl(hst, tpl_main);
     ctx.req_handled = true;
 }
@@ -1,10 +1,28 @@
+#define _GNU_SOURCE
 #include "hst.h"
-#include <sys/ioctl.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 #pragma GCC diagnostic ignored "-Wformat-nonliteral"
@@ -34,47 +52,234 @@ typedef unsigned int uint;
 ****************************************************************************/
 
 //!
-// Memory allocator object.
-static struct _mem {
-    char *start;        // start of memory allocated by malloc()
-    int total;          // total amount of memory
-    int current;        // current amount of memory allocated by this allocator
-} mem;
+// Block of memory, data of block follows this header.
+typedef struct _mem_block_t mem_block_t;
+struct _mem_block_t {
+    mem_block_t *next;  // next block of allocator or free block of pool
+    int base;           // allocator position of block data start
+    int size;           // size of block data
+};
+
+
+// Pool of free blocks of the same size, which are shared by allocators.
+// Blocks are taken from system on demand and returned to it by
+// mem_pool_deinit(). Some of them may be mapped at once by
+// mem_pool_reserve().
+typedef struct _mem_pool_t {
+    mem_block_t *free;  // list of free blocks
+    int block_size;     // size of block data
+    int num;            // number of blocks taken from system
+    char *region;       // memory mapped for reserved blocks, or NULL
+    size_t region_size;
+} mem_pool_t;
+
+
+/* Flags of memory reserved for pool.
+ *
+ * MEM_HUGE
+ *      Use huge pages. Transparent huge pages are used, if there are no
+ *      reserved ones.
+ * MEM_POPULATE
+ *      Prefault pages, so first use of memory does not stall.
+ * MEM_LOCK
+ *      Lock pages in memory.
+ */
+#define MEM_HUGE        1
+#define MEM_POPULATE    2
+#define MEM_LOCK        4
+#define MEM_HUGE_PAGE   (2*1024*1024)
+
+
+// Memory allocator object. Memory is chain of blocks, allocation is made
+// in last block and new block is added when there is no space in it.
+// Position of allocator counts bytes of all blocks before it, so position
+// is used as checkpoint.
+typedef struct _mem_t {
+    mem_pool_t *pool;   // pool blocks are taken from
+    mem_block_t *first; // first block
+    mem_block_t *last;  // block allocations are made in
+    int total;          // max amount of memory
+    int current;        // current position of allocator
+    int odd;            // number of blocks, which size differs from pool`s
+    char padding[4];
+} mem_t;
 
 
-static int mem_init(int size) {
-    if (mem.start) {
-        ERROR("Memory already initialised.");
+static inline char *mem_block_data(mem_block_t *b) {
+    return (char *)(b + 1);
+}
+
+
+static void mem_pool_init(mem_pool_t *pool, int block_size) {
+    pool->free = NULL;
+    pool->block_size = block_size;
+    pool->num = 0;
+    pool->region = NULL;
+    pool->region_size = 0;
+}
+
+
+// Map memory for 'num' blocks of pool at once, see MEM_* flags.
+static int mem_pool_reserve(mem_pool_t *pool, int num, int flags) {
+    size_t stride = sizeof(mem_block_t) + (size_t)pool->block_size;
+    size_t size = stride * (size_t)num;
+    char *p = MAP_FAILED;
+
+    if (flags & MEM_HUGE) {
+        size += -size & (MEM_HUGE_PAGE-1);
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|
+                 (flags & MEM_POPULATE ? MAP_POPULATE : 0), -1, 0);
+    }
+    if (p == MAP_FAILED) {
+        // transparent huge pages are advised before pages are populated
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|
+                 (flags == MEM_POPULATE ? MAP_POPULATE : 0), -1, 0);
+        if (p == MAP_FAILED) {
+            ERROR("%s.", strerror(errno));
+            return HST_RES_ERR;
+        }
+        if (flags & MEM_HUGE) {
+            madvise(p, size, MADV_HUGEPAGE);
+            if (flags & MEM_POPULATE)
+                memset(p, 0, size);
+        }
+    }
+    if ((flags & MEM_LOCK) && 0 != mlock(p, size)) {
+        ERROR("%s.", strerror(errno));
+        munmap(p, size);
         return HST_RES_ERR;
     }
-    mem.start = malloc((size_t)size);
-    if (mem.start == NULL) {
-        ERROR("Not enough memory.");
+
+    for (int i = num-1; i >= 0; i--) {
+        mem_block_t *b = (mem_block_t *)(p + stride*(size_t)i);
+        b->size = pool->block_size;
+        b->next = pool->free;
+        pool->free = b;
+    }
+    pool->num += num;
+    pool->region = p;
+    pool->region_size = size;
+    return HST_RES_OK;
+}
+
+
+static void mem_pool_deinit(mem_pool_t *pool) {
+    char *r = pool->region;
+    while (pool->free) {
+        mem_block_t *b = pool->free;
+        pool->free = b->next;
+        if ((char *)b < r || (char *)b >= r + pool->region_size)
+            free(b);
+    }
+    if (r)
+        munmap(r, pool->region_size);
+    pool->region = NULL;
+    pool->region_size = 0;
+    pool->num = 0;
+}
+
+
+static int mem_init(mem_t *m, mem_pool_t *pool, int size) {
+    if (m->pool) {
+        ERROR("Memory already initialised.");
         return HST_RES_ERR;
     }
-    mem.total = size;
-    mem.current = 0;
+    m->pool = pool;
+    m->first = NULL;
+    m->last = NULL;
+    m->total = size;
+    m->current = 0;
+    m->odd = 0;
     return HST_RES_OK;
 }
 
 
-static inline void mem_deinit(void) {
-    free(mem.start);
-    memset(&mem, 0, sizeof(mem));
+/* Add block with at least 'size' bytes to allocator. Block of pool is
+ * used if it is big enough, else bigger block is taken from system, it is
+ * not returned to pool later.
+ *
+ * Input:
+ *      size - amount of memory needed
+ *      cap - desired size of block, it is bigger than 'size' for buffer,
+ *            which is likely to grow more
+ *      quiet - do not report that limit of allocator is reached, caller
+ *            has other way to go on
+ */
+static mem_block_t *mem_block_add(mem_t *m, int size, int cap, bool quiet) {
+    mem_pool_t *pool = m->pool;
+    int base = m->last ? m->last->base + m->last->size : 0;
+    if (base + size > m->total) {
+        if (!quiet)
+            ERROR("Not enough memory. Requested %u bytes.", (uint)size);
+        return NULL;
+    }
+
+    mem_block_t *b;
+    if (size <= pool->block_size && pool->free) {
+        b = pool->free;
+        pool->free = b->next;
+    } else {
+        if (cap > m->total - base) cap = m->total - base;
+        if (cap < pool->block_size) cap = pool->block_size;
+        cap += -cap & (int)(sizeof(void*)-1);
+        b = malloc(sizeof(*b) + (size_t)cap);
+        if (b == NULL) {
+            ERROR("Not enough memory.");
+            return NULL;
+        }
+        b->size = cap;
+        if (cap == pool->block_size)
+            pool->num++;
+        else
+            m->odd++;
+    }
+    b->next = NULL;
+    b->base = base;
+    if (m->last)
+        m->last->next = b;
+    else
+        m->first = b;
+    m->last = b;
+    m->current = base;
+    return b;
+}
+
+
+// Return chain of blocks from 'b' to last block to pool. Chain is put to
+// free list at once, unless it has blocks of other size, which are freed.
+static void mem_block_put(mem_t *m, mem_block_t *b) {
+    mem_pool_t *pool = m->pool;
+    if (m->odd == 0) {
+        m->last->next = pool->free;
+        pool->free = b;
+        return;
+    }
+    while (b) {
+        mem_block_t *next = b->next;
+        if (b->size == pool->block_size) {
+            b->next = pool->free;
+            pool->free = b;
+        } else {
+            free(b);
+            m->odd--;
+        }
+        b = next;
+    }
 }
 
 
-static void *mem_alloc(int size) {
-    void *ret = NULL;
+static void *mem_alloc(mem_t *m, int size) {
     // align up
-    int current = mem.current + (-mem.current & (int)(sizeof(void*)-1));
-    if (current + size > mem.total) {
-        ERROR("Not enough memory. Requested %u bytes.", (uint)size);
-    } else {
-        ret = mem.start + current;
-        mem.current = current + size;
+    int current = m->current + (-m->current & (int)(sizeof(void*)-1));
+    mem_block_t *b = m->last;
+    if (b == NULL || current + size > b->base + b->size) {
+        b = mem_block_add(m, size, size, false);
+        if (b == NULL) return NULL;
+        current = b->base;
     }
-    return ret;
+    m->current = current + size;
+    return mem_block_data(b) + (current - b->base);
 }
 
 
@@ -86,21 +291,119 @@ static void *mem_alloc(int size) {
 //}
 
 
-static int mem_grow(int size) {
-    if (mem.current + size > mem.total)
-        return HST_RES_ERR;
-    mem.current += size;
-    return HST_RES_OK;
+// Ptr to memory at current position.
+static inline char *mem_top(mem_t *m) {
+    if (m->last == NULL) return NULL;
+    return mem_block_data(m->last) + (m->current - m->last->base);
+}
+
+
+/* Grow last allocation. If there is no space for it in block, then data
+ * is moved to new block with space to grow twice. Block, which has no other
+ * allocations, is replaced by new one, so its space is not lost.
+ *
+ * Input:
+ *      ptr - last allocation
+ *      size - size of allocation
+ *      add - amount to be added
+ *      quiet - do not report that limit of allocator is reached
+ * Return:
+ *      ptr to allocation, which may be moved, or NULL
+ */
+static void *mem_grow(mem_t *m, void *ptr, int size, int add, bool quiet) {
+    if ((char *)ptr + size != mem_top(m)) {
+        ERROR("Not last allocation.");
+        return NULL;
+    }
+    mem_block_t *b = m->last;
+    if (m->current + add <= b->base + b->size) {
+        m->current += add;
+        return ptr;
+    }
+
+    // block with the only allocation is unlinked, new one takes its place
+    bool alone = (ptr == mem_block_data(b));
+    mem_block_t *prev = NULL;
+    if (alone) {
+        if (b != m->first)
+            for (prev = m->first; prev->next != b; prev = prev->next);
+        m->last = prev;
+        if (prev) prev->next = NULL;
+        else m->first = NULL;
+    }
+
+    // otherwise previous space of allocation is left unused
+    m->current -= size;
+    mem_block_t *n = mem_block_add(m, size + add, 2*(size + add), quiet);
+    if (n == NULL) {
+        if (alone) {
+            m->last = b;
+            if (prev) prev->next = b;
+            else m->first = b;
+        }
+        m->current += size;
+        return NULL;
+    }
+    memcpy(mem_block_data(n), ptr, (size_t)size);
+    m->current = n->base + size + add;
+
+    if (alone) {
+        mem_pool_t *pool = m->pool;
+        if (b->size == pool->block_size) {
+            b->next = pool->free;
+            pool->free = b;
+        } else {
+            free(b);
+            m->odd--;
+        }
+    }
+    return mem_block_data(n);
+}
+
+
+static inline int mem_checkpoint_get(mem_t *m) {
+    return m->current;
+}
+
+
+// Restore position, blocks after it are returned to pool.
+static void mem_checkpoint_restore(mem_t *m, int checkpoint) {
+    // position is usually restored within the same block
+    if (m->last == NULL || m->last->base < checkpoint) {
+        m->current = checkpoint;
+        return;
+    }
+
+    mem_block_t *prev = NULL, *b = m->first;
+    for (; b && b->base < checkpoint; b = b->next)
+        prev = b;
+    if (b) {
+        mem_block_put(m, b);
+        if (prev) prev->next = NULL;
+        else m->first = NULL;
+        m->last = prev;
+    }
+    m->current = checkpoint;
 }
 
 
-static inline int mem_checkpoint_get(void) {
-    return mem.current;
+static inline void mem_deinit(mem_t *m) {
+    if (m->pool)
+        mem_checkpoint_restore(m, 0);
+    memset(m, 0, sizeof(*m));
 }
 
 
-static inline void mem_checkpoint_restore(int checkpoint) {
-    mem.current = checkpoint;
+// Check if ptr is in memory allocated before checkpoint.
+static bool mem_has(mem_t *m, const void *ptr, int checkpoint) {
+    for (mem_block_t *b = m->first; b && b->base < checkpoint; b = b->next) {
+        const char *d = mem_block_data(b);
+        int len = checkpoint - b->base < b->size ?
+                  checkpoint - b->base : b->size;
+        if ((const char *)ptr >= d && (const char *)ptr < d + len)
+            return true;
+    }
+    return false;
 }
 
 
@@ -111,32 +414,99 @@ static inline void mem_checkpoint_restore(int checkpoint) {
 //!
 typedef struct _buf_t {
     char *buf;      // ptr to buffer
+    mem_t *mem;     // memory allocator used for buffer
     int tot;        // total size of buffer
     int len;        // length of data in buffer
     int sta;        // start of not yet handled data
-    char padding[4];
+    bool mirror;    // buffer is a mirrored ring, see buf_mirror_init()
+    char padding[3];
 } buf_t;
 
 
 // Allocate memory for buffer.
-int buf_alloc(buf_t *buf, int size) {
-    char *b = mem_alloc(size);
+int buf_alloc(buf_t *buf, mem_t *m, int size) {
+    char *b = mem_alloc(m, size);
     if (b == NULL) return HST_RES_ERR;
 
     buf->buf = b;
+    buf->mem = m;
+    buf->tot = size;
+    buf->len = 0;
+    buf->sta = 0;
+    buf->mirror = false;
+    return HST_RES_OK;
+}
+
+
+// Map buffer as a ring: the same pages are mapped twice one after another,
+// so data wrapping around end of buffer is seen contiguous. Data of ring
+// is never moved, offsets of it are decreased by buffer size instead.
+// Size must be a multiple of page size.
+int buf_mirror_init(buf_t *buf, int size) {
+    int fd = memfd_create("hst", MFD_CLOEXEC);
+    if (fd == -1) {
+        ERROR("%s.", strerror(errno));
+        return HST_RES_ERR;
+    }
+
+    // reserve address space for both mappings first
+    char *p = MAP_FAILED;
+    if (0 == ftruncate(fd, size))
+        p = mmap(NULL, 2*(size_t)size, PROT_NONE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED && (
+            MAP_FAILED == mmap(p, (size_t)size, PROT_READ|PROT_WRITE,
+                               MAP_SHARED|MAP_FIXED, fd, 0) ||
+            MAP_FAILED == mmap(p+size, (size_t)size, PROT_READ|PROT_WRITE,
+                               MAP_SHARED|MAP_FIXED, fd, 0))) {
+        munmap(p, 2*(size_t)size);
+        p = MAP_FAILED;
+    }
+    if (p == MAP_FAILED) {
+        ERROR("%s.", strerror(errno));
+        close(fd);
+        return HST_RES_ERR;
+    }
+    close(fd);
+
+    buf->buf = p;
+    buf->mem = NULL;
     buf->tot = size;
     buf->len = 0;
     buf->sta = 0;
+    buf->mirror = true;
     return HST_RES_OK;
 }
 
 
-// Grow memory, previously allocated for buffer.
+void buf_mirror_deinit(buf_t *buf) {
+    if (buf->mirror)
+        munmap(buf->buf, 2*(size_t)buf->tot);
+    memset(buf, 0, sizeof(*buf));
+}
+
+
+// Grow memory, previously allocated for buffer. Buffer data may be moved.
 // Works only if this buffer allocation was a last memory allocation.
 int buf_grow(buf_t *buf, int size) {
-    if (HST_RES_OK != mem_grow(size))
+    char *b = mem_grow(buf->mem, buf->buf, buf->tot, size, false);
+    if (b == NULL)
+        return HST_RES_INTERNAL;
+
+    buf->buf = b;
+    buf->tot += size;
+    return HST_RES_OK;
+}
+
+
+// Grow buffer like buf_grow(), but reaching memory limit is not reported,
+// caller has other way to go on then.
+int buf_try_grow(buf_t *buf, int size) {
+    char *b = mem_grow(buf->mem, buf->buf, buf->tot, size, true);
+    if (b == NULL)
         return HST_RES_INTERNAL;
 
+    buf->buf = b;
     buf->tot += size;
     return HST_RES_OK;
 }
@@ -155,11 +525,18 @@ int buf_add(buf_t *buf, const void *ptr, int size) {
 
 
 int buf_shift(buf_t *buf) {
+    if (buf->mirror) {
+        if (buf->sta < buf->tot)
+            return HST_RES_ERR;
+        buf->sta -= buf->tot;
+        buf->len -= buf->tot;
+        return HST_RES_OK;
+    }
     if (buf->sta == 0)
         return HST_RES_ERR;
 
     int len = buf->len - buf->sta;
-    memcpy(buf->buf, buf->buf+buf->sta, (uint)len);
+    memmove(buf->buf, buf->buf+buf->sta, (uint)len);
     buf->sta = 0;
     buf->len = len;
     return HST_RES_OK;
@@ -220,6 +597,146 @@ int tok_cmpi_strz(tok_t *tok, const char *psz) {
 }
 
 
+// Check if comma separated list in token contains zero-terminated string.
+// Comparison is case-insensitive.
+bool tok_list_has(const tok_t *list, const char *psz) {
+    tok_t tok;
+    const char *p = list->ptr, *end = list->ptr + list->len;
+    for (;;) {
+        for (; p < end && (*p == ' ' || *p == '\t' || *p == ','); p++)
+            continue;
+        if (p == end) break;
+        tok.ptr = p;
+        for (; p < end && *p != ',' && *p != ' ' && *p != '\t'; p++)
+            continue;
+        tok.len = (int)(p - tok.ptr);
+        if (0 == tok_cmpi_strz(&tok, psz))
+            return true;
+    }
+    return false;
+}
+
+
+/****************************************************************************
+* Scanning.
+****************************************************************************/
+
+/* Find first byte in range [p, end), which is equal to 'a' or is a control
+ * byte other than HTAB. So delimiter of token and end of line (or bad byte)
+ * are found in one pass.
+ * Returns 'end' if there is no such byte.
+ * Kernel is chosen at runtime by scan_init() according to cpu features.
+ */
+typedef const char *(*scan_func_t)(const char *p, const char *end, char a);
+
+
+static const char *scan_scalar(const char *p, const char *end, char a) {
+    for (; p < end; p++)
+        if (*p == a || ((unsigned char)*p < 0x20 && *p != '\t'))
+            return p;
+    return end;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char *scan_sse2(const char *p, const char *end, char a) {
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vctl = _mm_set1_epi8(0x1f);
+    __m128i vtab = _mm_set1_epi8('\t');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        // unsigned v <= 0x1f, except HTAB
+        __m128i ctl = _mm_cmpeq_epi8(_mm_max_epu8(v, vctl), vctl);
+        ctl = _mm_andnot_si128(_mm_cmpeq_epi8(v, vtab), ctl);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, va), ctl);
+        uint bits = (uint)_mm_movemask_epi8(m);
+        if (bits)
+            return p + __builtin_ctz(bits);
+    }
+    return scan_scalar(p, end, a);
+}
+
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, char a) {
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vctl = _mm256_set1_epi8(0x1f);
+    __m256i vtab = _mm256_set1_epi8('\t');
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_max_epu8(v, vctl), vctl);
+        ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, vtab), ctl);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, va), ctl);
+        uint bits = (uint)_mm256_movemask_epi8(m);
+        if (bits)
+            return p + __builtin_ctz(bits);
+    }
+    // clear upper halves before legacy SSE code, else each SSE
+    // instruction pays for AVX state transition
+    _mm256_zeroupper();
+    return scan_sse2(p, end, a);
+}
+#endif
+
+
+static scan_func_t scan_func = scan_scalar;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+
+static void scan_select(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_func = scan_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scan_func = scan_sse2;
+#endif
+}
+
+
+static void scan_init(void) {
+    pthread_once(&scan_once, scan_select);
+}
+
+
+static inline const char *scan(const char *p, const char *end, char a) {
+    return scan_func(p, end, a);
+}
+
+
+/* Boyer-Moore-Horspool search of pattern, which is prepared once by
+ * bmh_init() and then searched for in many buffers.
+ */
+typedef struct _bmh_t {
+    const char *pat;    // pattern, it is not copied
+    int len;            // pattern length, 1..255
+    unsigned char skip[256];  // shift by last byte of window
+    char padding[4];
+} bmh_t;
+
+
+static void bmh_init(bmh_t *b, const char *pat, int len) {
+    b->pat = pat;
+    b->len = len;
+    memset(b->skip, len, sizeof(b->skip));
+    for (int i = 0; i < len-1; i++)
+        b->skip[(unsigned char)pat[i]] = (unsigned char)(len-1 - i);
+}
+
+
+// Find pattern in range [p, end), returns 'end' if it is not found.
+static const char *bmh_find(const bmh_t *b, const char *p, const char *end) {
+    int last = b->len - 1;
+    char c = b->pat[last];
+    for (; end - p > last; p += b->skip[(unsigned char)p[last]]) {
+        if (p[last] == c && 0 == memcmp(p, b->pat, (size_t)last))
+            return p;
+    }
+    return end;
+}
+
+
 /****************************************************************************
 * Html template system.
 ****************************************************************************/
@@ -259,31 +776,76 @@ typedef struct _hst_tpl_elt_t {
 #define DFLT_CONF_PORT          80
 #define DFLT_CONF_BACKLOG       32
 #define DFLT_CONF_MEM_TOTAL     (32*1024)
+#define DFLT_CONF_MAX_CONNS     64
+#define DFLT_CONF_CONN_MEM      (256*1024)
+#define DFLT_CONF_KEEPALIVE_TIMEOUT 5
+#define DFLT_CONF_HEADER_TIMEOUT    5
+#define DFLT_CONF_BODY_TIMEOUT      15
+#define DFLT_CONF_WRITE_TIMEOUT     10
+#define DFLT_CONF_DEFER_TIMEOUT     30
+#define DFLT_CONF_KEEPALIVE_MAX     100
 
 
 /* Constants.
  *
+ * MEM_BLOCK_SIZE
+ *      Size of memory blocks, which are shared by allocators of library
+ *      instance and connections.
  * HBUF_SIZE
  *      Size of buffer for http request/reply headers.
  *      note: rfc7230: "It is RECOMMENDED that all HTTP senders and recipients
  *      support, at a minimum, request-line lengths of 8000 octets."
- * HREAD_SIZE
- *      Amount of data added to headers buffer per one read operation.
- *      It is relatively small to reduce size of body that goes to headers
- *      buffer if there is a body present in request.
+ *      Buffer is a mirrored ring if size is a multiple of page size.
+ * MPART_SIZE
+ *      Size of buffer for streamed multipart body. Part headers must fit
+ *      in it.
+ * BREAD_SIZE
+ *      Minimal free space in body buffer for reading chunked body, buffer
+ *      grows by this amount when it is full.
+ * OBUF_SIZE
+ *      Size of buffer for reply headers. Small reply bodies are copied
+ *      there too, so replies to pipelined requests are sent together.
+ * OBUF_FLUSH
+ *      Amount of data in output buffer after which it is sent without
+ *      waiting for replies to other pipelined requests.
+ * ROUTE_PARAMS_MAX
+ *      Maximum number of parameters captured by one route.
  * CHUNK_SIZE
- *      Maximum chunk size for chunked transfer of reply body.
+ *      Amount by which buffer of chunked reply body grows, when client does
+ *      not read it fast enough.
+ * CHUNK_LINE
+ *      Space for CRLF ending previous chunk and size line of next chunk,
+ *      with terminating zero.
+ * WHEEL_SIZE
+ *      Number of one second slots in timer wheel of connection deadlines.
+ *      Must be a power of two. Deadlines further in future stay in their
+ *      slot for more than one turn of the wheel.
+ * EVENTS_MAX
+ *      Maximum number of events handled per one call to epoll_wait().
+ * UBUF_SIZE, UBUF_NUM
+ *      Size and number of buffers provided to io_uring for receiving data.
+ *      Received data is copied to connection buffers, so provided buffer
+ *      is returned to io_uring right after completion is handled.
  */
+#define MEM_BLOCK_SIZE          (16*1024)
 #define HBUF_SIZE               (8*1024)
-#define HREAD_SIZE              256
+#define BREAD_SIZE              (4*1024)
+#define MPART_SIZE              (8*1024)
+#define OBUF_SIZE               (8*1024)
+#define OBUF_FLUSH              (OBUF_SIZE/2)
 #define CHUNK_SIZE              (4*1024)
+#define CHUNK_LINE              16
+#define ROUTE_PARAMS_MAX        16
+#define WHEEL_SIZE              64
+#define EVENTS_MAX              64
+#define UBUF_SIZE               (4*1024)
+#define UBUF_NUM                32
 
 
 /* HST states.
  *
  * STATE_NOT_INIT
- *      Not initialised. It is set before first call to hst_init()
- *      or after a call to hst_deinit().
+ *      Not initialised. Instance is being created by hst_init().
  * STATE_CFG
  *      Configuration. It is set after a call to hst_init().
  * STATE_READ
@@ -297,6 +859,8 @@ typedef struct _hst_tpl_elt_t {
  *      header will be generated and no chunked transfer will be used.
  * STATE_WR_BODY_CHUNKED
  *      Reply body does not fit in hst memory. Switched to chunked transfer.
+ * STATE_WR_BODY_FD
+ *      Reply body is sent from file descriptor.
  * STATE_WR_ERROR
  *      Error happened during write operation.
  */
@@ -308,31 +872,307 @@ typedef enum _hst_state {
     STATE_WR_HDR,
     STATE_WR_BODY,
     STATE_WR_BODY_CHUNKED,
+    STATE_WR_BODY_FD,
     STATE_WR_ERROR
 } hst_state_t;
 
 
-static struct _hst {
+/* Connection states.
+ *
+ * CONN_FREE
+ *      Connection object is not used.
+ * CONN_RD_HEAD
+ *      Reading request line and headers.
+ * CONN_RD_BODY
+ *      Reading request body of known length.
+ * CONN_RD_CHUNKED
+ *      Reading request body sent with chunked transfer coding.
+ * CONN_READY
+ *      Request is read and waits in queue to be handed to application.
+ * CONN_HANDLE
+ *      Request is being handled by application.
+ * CONN_RD_STREAM
+ *      Waiting for data of body, which is read by application with
+ *      hst_read_body(). Request is handed to application again when data
+ *      arrives.
+ * CONN_DEFERRED
+ *      Reply is deferred by application with hst_req_defer(). Socket is
+ *      only watched for hang up of client.
+ * CONN_CLOSED
+ *      Socket of deferred request is closed, as client hung up or defer
+ *      timeout expired. Request is kept until hst_req_resume() is called.
+ * CONN_WRITE
+ *      Reply is being sent to client. Next request is not read until
+ *      sending is complete.
+ */
+typedef enum _conn_state {
+    CONN_FREE,
+    CONN_RD_HEAD,
+    CONN_RD_BODY,
+    CONN_RD_CHUNKED,
+    CONN_READY,
+    CONN_HANDLE,
+    CONN_RD_STREAM,
+    CONN_DEFERRED,
+    CONN_CLOSED,
+    CONN_WRITE
+} conn_state_t;
+
+
+/* Chunked body decoder states.
+ *
+ * CH_SIZE
+ *      Reading chunk size digits.
+ * CH_EXT
+ *      Skipping chunk extensions up to end of chunk size line.
+ * CH_SIZE_LF
+ *      Waiting for LF of chunk size line.
+ * CH_DATA
+ *      Reading chunk data.
+ * CH_DATA_CR, CH_DATA_LF
+ *      Waiting for CRLF after chunk data.
+ * CH_TRAILER
+ *      Waiting for trailer field line or empty line after last chunk.
+ * CH_TRAILER_LINE
+ *      Skipping trailer field line.
+ * CH_TRAILER_LF
+ *      Waiting for LF of trailer field line.
+ * CH_END_LF
+ *      Waiting for LF of empty line that ends body.
+ * CH_DONE
+ *      Body is decoded.
+ */
+typedef enum _chunk_state {
+    CH_SIZE,
+    CH_EXT,
+    CH_SIZE_LF,
+    CH_DATA,
+    CH_DATA_CR,
+    CH_DATA_LF,
+    CH_TRAILER,
+    CH_TRAILER_LINE,
+    CH_TRAILER_LF,
+    CH_END_LF,
+    CH_DONE
+} chunk_state_t;
+
+
+/* Request parser states.
+ *
+ * PARSE_REQ_LINE
+ *      Waiting for request line.
+ * PARSE_HEADER
+ *      Waiting for header line or empty line that ends headers section.
+ */
+typedef enum _parse_state {
+    PARSE_REQ_LINE,
+    PARSE_HEADER
+} parse_state_t;
+
+
+// Client connection.
+typedef struct _conn_t conn_t;
+struct _conn_t {
+    conn_t *next;           // next element in free list or ready queue
+    int sd;                 // client socket descriptor
+    conn_state_t state;     // connection state
+    uint events;            // epoll events connection is registered for
+    parse_state_t parse;    // request parser state
+    int line;               // headers buffer offset of line being parsed
+    int scan;               // headers buffer offset where search stopped
+    int delim[2];           // headers buffer offsets of delimiters in line
+    int delims;             // number of delimiters found in line
+    uint gen;               // generation, changed when connection is closed
+    bool rd_pending;        // io_uring receive is submitted
+    bool wr_pending;        // io_uring send is submitted
+    bool idle;              // waiting for next request on persistent connection
+    bool hup_pending;       // io_uring poll for hang up is submitted
+    char padding1[4];
+
+    mem_t mem;              // memory for request and reply
+    buf_t hbuf;             // buffer for request headers
+    buf_t obuf;             // buffer for reply headers and small bodies
+    buf_t bbuf;             // buffer for request/reply body
+
+    hst_req_t *req;         // request object
+    struct _mpart_t *mpart; // multipart parser of streamed body
+
+    int body_len;           // body length
+    int body_chunked;       // chunked transfer-encoding flag
+    int chunk_pos;          // length of decoded data in body buffer
+    chunk_state_t chunk_state;  // chunked body decoder state
+    int chunk_left;         // chunk data not decoded yet, -1 if size unknown
+    int hdr_end;            // headers buffer offset of headers section end
+    int hdr_sta;            // headers buffer offset of request start
+    int wr_off;             // amount of reply data already sent
+    int requests;           // number of requests read from connection
+    int checkpoint;         // memory checkpoint after connection buffers
+    int res_sta;            // output buffer offset of current reply
+    bool keep_alive;        // keep connection open after reply is sent
+    bool http_1_0;          // request uses HTTP/1.0
+    bool out_body;          // body buffer is a part of reply to be sent
+    bool hdr_content_len;   // 'Content-Length' header is parsed
+    bool hdr_transfer_enc;  // 'Transfer-Encoding' header is parsed
+    bool body_stream;       // body is read by application, hst_read_body()
+    bool body_err;          // error while body is read by application
+    bool chunk_open;        // reply chunk data is queued without its CRLF
+    bool res_no_body;       // reply status code does not allow body
+    bool res_head;          // reply to HEAD request, its body is not sent
+    char padding[2];
+    hst_hdr_t **last_hdr;   // ptr to link to next header in list
+
+    time_t deadline;        // connection is closed at this time
+    time_t body_deadline;   // streamed body is to be read by this time
+    conn_t *tnext;          // next connection in timer wheel slot
+    conn_t **tpprev;        // ptr to link to this connection, NULL if no timer
+
+    int out_fd;             // descriptor reply body is sent from, or -1
+    bool out_pipe;          // descriptor is a pipe, splice() is used
+    char padding2[3];
+    off_t out_off;          // offset of body data not sent yet
+    off_t out_len;          // length of body data not sent yet
+
+    struct iovec iov[2];    // reply data submitted to io_uring
+    struct msghdr msg;
+};
+
+
+// Io_uring instance.
+typedef struct _uring_t {
+    int fd;                 // ring descriptor, -1 if io_uring is not used
+    uint to_submit;         // number of prepared but not submitted entries
+    uint sq_entries;
+    uint sq_mask;
+    uint sq_tail;           // local copy of submission queue tail
+    uint cq_mask;
+    uint *sq_khead;         // submission queue head, updated by kernel
+    uint *sq_ktail;
+    uint *cq_khead;
+    uint *cq_ktail;         // completion queue tail, updated by kernel
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;          // mapped rings
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+
+    struct io_uring_buf_ring *br;  // ring of provided buffers
+    char *bufs;             // memory for provided buffers
+    uint br_tail;           // local copy of provided buffers ring tail
+    char padding[4];
+} uring_t;
+
+
+// Kinds of io_uring operations stored in user data of submission entries.
+#define UOP_ACCEPT      1
+#define UOP_RECV        2
+#define UOP_SEND        3
+#define UOP_POLLOUT     4
+#define UOP_WAKE        5
+#define UOP_POLLHUP     6
+
+
+// Methods handled by routes, index of handler in route node.
+#define ROUTE_GET       0
+#define ROUTE_POST      1
+#define ROUTE_HEAD      2
+#define ROUTE_METHODS   3
+
+
+// Node of route tree, it matches one path element. Literal children are
+// linked in list while routes are added, then list is compiled to array
+// sorted by name for binary search.
+typedef struct _route_node_t route_node_t;
+struct _route_node_t {
+    route_node_t *next;         // next literal sibling
+    route_node_t *first;        // first literal child
+    route_node_t **lits;        // compiled literal children
+    route_node_t *param;        // ':name' child, matches any element
+    route_node_t *wild;         // '*name' child, matches rest of path
+    const char *name;           // element or parameter name
+    int len;                    // element name length
+    int lits_num;               // number of compiled literal children
+    hst_route_func_t func[ROUTE_METHODS];  // handlers by method
+    void *arg[ROUTE_METHODS];   // handler arguments
+};
+
+
+// Library instance.
+struct _hst_ctx_t {
     hst_state_t state;  // module state
     int checkpoint;     // memory checkpoint
+    mem_pool_t pool;    // blocks of memory for allocators of instance
+    mem_t mem;          // memory for templates and other long-living objects
     int ss;             // server socket descriptor
-    int sc;             // client socket descriptor
-
+    int epfd;           // epoll descriptor
+    uring_t ring;       // io_uring, used instead of epoll if available
+
+    int conn_mem;       // amount of memory for each connection
+    int keepalive_timeout;  // idle timeout for persistent connections
+    int header_timeout;     // time limit for reading request headers
+    int body_timeout;       // time limit for reading request body
+    int write_timeout;      // time limit for reply write without progress
+    int defer_timeout;      // time limit for deferred reply
+    int keepalive_max;      // max number of requests per connection
+    int conns_num;      // number of elements in conns array
+    int hbufs_num;      // number of free headers buffers
+    int wake_fd;        // eventfd to wake instance from other threads
+    bool req_views;     // requests have header and path views, not lists
+    bool body_stream;   // request body is read by hst_read_body()
+    bool mirror;        // headers buffers are mirrored rings
+    bool woken;         // instance was woken, hst_read() returns
+    char padding[4];
+    uint64_t wake_cnt;  // counter read from wake_fd by io_uring
+    buf_t *hbufs;       // free mirrored headers buffers, one per connection
+    conn_t *conns;      // array of connections
+    conn_t *conn_free;  // first element of free connections list
+    conn_t *ready_first;  // queue of requests ready to be handled
+    conn_t *ready_last;
+
+    conn_t *conn;       // connection of current request
     hst_req_t *req;     // current request
 
-    buf_t hbuf;         // buffer for request/reply headers
-    buf_t bbuf;         // buffer for request/reply body
-
-    int body_len;       // body length
-    int body_chunked;   // chunked transfer-encoding flag
+    time_t now;         // time of last wake up from epoll_wait()
+    time_t expired;     // time of last check for expired connections
+    conn_t *wheel[WHEEL_SIZE];  // connections by deadline modulo wheel size
 
     hst_tpl_fdesc_t *fdesc_first;  // ptr to first
-} me;
+    route_node_t *routes;   // root of route tree, NULL if there are no routes
+    const int *stop;    // instances of hst_run() stop when it is set
+    void *udata;        // application data
+};
 
 
-// Create zero terminated string in hst memory.
-static char *_hst_create_strz(const char *p, int len) {
-    char *ret = mem_alloc(len+1);
+// Worker thread of hst_run().
+typedef struct _hst_worker_t hst_worker_t;
+
+
+// State shared by workers of hst_run().
+typedef struct {
+    pthread_mutex_t lock;       // protects instances of workers
+    hst_worker_t *workers;
+    int workers_num;
+    int stop;                   // workers must stop, it is accessed atomically
+} hst_run_t;
+
+
+struct _hst_worker_t {
+    hst_conf_t conf;            // configuration for worker`s instance
+    int idx;                    // worker number
+    hst_worker_func_t func;     // application function
+    void *arg;                  // application function argument
+    hst_run_t *run;             // shared state
+    hst_ctx_t *ctx;             // instance of worker, NULL if it is not running
+    pthread_t thread;
+    int cpu;                    // cpu to pin worker to
+    int res;                    // result of worker`s instance init
+};
+
+
+// Create zero terminated string in memory 'm'.
+static char *_hst_create_strz(mem_t *m, const char *p, int len) {
+    char *ret = mem_alloc(m, len+1);
     if (ret) {
         memcpy(ret, p, (size_t)len);
         ret[len] = 0;
@@ -349,10 +1189,11 @@ static char *_hst_create_strz(const char *p, int len) {
 //          returned value points to found element
 //      else
 //          returned value points to added element
-static hst_tpl_fdesc_t *_hst_tpl_function_add(const char *name, bool *found) {
+static hst_tpl_fdesc_t *_hst_tpl_function_add(hst_ctx_t *ctx,
+                                              const char *name, bool *found) {
     // search
-    hst_tpl_fdesc_t **p = &me.fdesc_first;  // previous
-    hst_tpl_fdesc_t *c = me.fdesc_first;    // current
+    hst_tpl_fdesc_t **p = &ctx->fdesc_first;  // previous
+    hst_tpl_fdesc_t *c = ctx->fdesc_first;    // current
     for (; c; p=&c->next, c=c->next) {
         if (0 == strcmp(name, c->name)) {
             *found = true;
@@ -361,7 +1202,7 @@ static hst_tpl_fdesc_t *_hst_tpl_function_add(const char *name, bool *found) {
     }
 
     // create new list element
-    hst_tpl_fdesc_t *n = mem_alloc(sizeof(*n));
+    hst_tpl_fdesc_t *n = mem_alloc(&ctx->mem, sizeof(*n));
     if (n == NULL) {  // error occured
         return NULL;
     }
@@ -374,192 +1215,169 @@ static hst_tpl_fdesc_t *_hst_tpl_function_add(const char *name, bool *found) {
 }
 
 
-// Check if client socket is ready for read or write.
-static int _hst_is_socket_ready(bool read) {
-    fd_set readfds, writefds, *r=NULL, *w=NULL;
-    if (read) {
-        r = &readfds;
-        FD_ZERO(r);
-        FD_SET(me.sc, r);
-    } else {
-        w = &writefds;
-        FD_ZERO(w);
-        FD_SET(me.sc, w);
-    }
-
-    struct timeval tv;
-    tv.tv_sec = 3;
-    tv.tv_usec = 0;
-    int res = select(me.sc+1, r, w, NULL, &tv);
-    if (res < 0) {
-        ERROR("%s.", strerror(errno));
-        return HST_RES_ERR;
-    }
-    if (res == 0) {
-        ERROR("Write timed out.");
-        return HST_RES_TIMEOUT;
-    }
-
-    bool error = false;
-    if (read) {
-        if (!FD_ISSET(me.sc, r)) error = true;
-    } else {
-        if (!FD_ISSET(me.sc, w)) error = true;
-    }
-    if (error) {
-        ERROR("Unknown error.");
-        return HST_RES_ERR;
-    }
-
-    return HST_RES_OK;
-}
-
-
-/* Add data from socket to buffer.
+/* Add data from client socket to buffer without waiting.
  * May add fewer bytes than requested.
  *
  * Input:
+ *      c - client connection
  *      buf - ptr to buffer
- *      num - number of bytes to add
+ *      num - number of bytes to add, must fit in buffer
  * Return:
  *      > 0 - number of bytes added
+ *      HST_RES_CONT - no data available now
  *      HST_RES_ERR - critical error
- *      HST_RES_INTERNAL - no memory
- *      HST_RES_BADREQUEST - bad request detected
  *      HST_RES_DISCONNECT - client disconnected
  */
-static int _hst_buf_add(buf_t *buf, int num) {
-    int res, ret = HST_RES_ERR;
-
-    // check size
-    if (num > buf->tot - buf->len) {
-        buf_shift(buf);
-        if (num > buf->tot - buf->len) {
-            num = buf->tot - buf->len;
-            if (num <= 0) {
-                ERROR("No space in buffer.");
-                ret = HST_RES_INTERNAL;
-                goto exit;
-            }
-        }
-    }
-
-    // wait for data
-    res = _hst_is_socket_ready(true);
-    if (res == HST_RES_TIMEOUT) {
-        // timeout considered equal to connection close
-        ret = HST_RES_DISCONNECT;
-        goto exit;
-    } else if (res != HST_RES_OK)
-        goto exit;
+static int _hst_buf_add(conn_t *c, buf_t *buf, int num) {
+    int ret = HST_RES_ERR;
 
     // read from socket
-    ssize_t s = recv(me.sc, buf->buf+buf->len, (size_t)num, 0);
+    ssize_t s = recv(c->sd, buf->buf+buf->len, (size_t)num, 0);
     if (s < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            ret = HST_RES_CONT;
+            goto exit;
+        }
         ERROR("%s.", strerror(errno));
         goto exit;
     } else if (s == 0) {  // connection closed
         ret = HST_RES_DISCONNECT;
         goto exit;
     }
-    buf->len+= s;
-    ret = num;
+    buf->len += (int)s;
+    ret = (int)s;
 
 exit:
     return ret;
 }
 
 
-/* Ensure that buffer contains a line terminated with CRLF.
- * If needed, read data to buffer from client socket.
+/* Classify header name as one of well-known headers.
+ * Name length and first character select the only candidate to compare.
  *
- * Input:
- *      buf - buffer
  * Return:
- *      > 0 - line length (including CRLF)
- *      HST_RES_ERR - critical error
- *      HST_RES_BADREQUEST - line expected but connection is closed
+ *      header id or HST_HDR_OTHER
  */
-static int _hst_line_get(buf_t *buf) {
-    int len = 0;
-    for (;;) {
-        for (; buf->sta + len < buf->len - 1; len++) {
-            if (buf->buf[buf->sta+len] == '\r'
-                     && buf->buf[buf->sta+len+1] == '\n') {
-                return len+2;
-            }
-        }
-        if (buf->len == buf->tot) {
-            ERROR("Line does not fit in buffer.");
-            return HST_RES_INTERNAL;
+static hst_hdr_id_t _hst_hdr_id(tok_t *name) {
+    const char *psz = NULL;
+    hst_hdr_id_t id = HST_HDR_OTHER;
+    char ch = name->ptr[0] | 0x20;
+
+#define HDR(s, i) do {psz = s; id = i;} while (0)
+    switch (name->len) {
+    case 4:  if (ch == 'h') HDR("Host", HST_HDR_HOST); break;
+    case 5:  if (ch == 'r') HDR("Range", HST_HDR_RANGE); break;
+    case 6:
+        if (ch == 'a') HDR("Accept", HST_HDR_ACCEPT);
+        else if (ch == 'c') HDR("Cookie", HST_HDR_COOKIE);
+        else if (ch == 'e') HDR("Expect", HST_HDR_EXPECT);
+        else if (ch == 'o') HDR("Origin", HST_HDR_ORIGIN);
+        break;
+    case 7:
+        if (ch == 'r') HDR("Referer", HST_HDR_REFERER);
+        else if (ch == 'u') HDR("Upgrade", HST_HDR_UPGRADE);
+        break;
+    case 10:
+        if (ch == 'c') HDR("Connection", HST_HDR_CONNECTION);
+        else if (ch == 'u') HDR("User-Agent", HST_HDR_USER_AGENT);
+        break;
+    case 12: if (ch == 'c') HDR("Content-Type", HST_HDR_CONTENT_TYPE); break;
+    case 13:
+        if (ch == 'a') HDR("Authorization", HST_HDR_AUTHORIZATION);
+        else if (ch == 'c') HDR("Cache-Control", HST_HDR_CACHE_CONTROL);
+        else if (ch == 'i') HDR("If-None-Match", HST_HDR_IF_NONE_MATCH);
+        break;
+    case 14: if (ch == 'c') HDR("Content-Length", HST_HDR_CONTENT_LENGTH); break;
+    case 15:
+        if (ch == 'x') {
+            HDR("X-Forwarded-For", HST_HDR_X_FORWARDED_FOR);
+        } else if (ch == 'a' && name->len > 7) {
+            if ((name->ptr[7] | 0x20) == 'e')
+                HDR("Accept-Encoding", HST_HDR_ACCEPT_ENCODING);
+            else
+                HDR("Accept-Language", HST_HDR_ACCEPT_LANGUAGE);
         }
-       int res = _hst_buf_add(buf, HREAD_SIZE);
-       if (res == 0) {  // connection is closed
-           return HST_RES_BADREQUEST;
-       } else if (res < 0)
-           break;
+        break;
+    case 17:
+        if (ch == 't') HDR("Transfer-Encoding", HST_HDR_TRANSFER_ENCODING);
+        else if (ch == 'i') HDR("If-Modified-Since", HST_HDR_IF_MODIFIED_SINCE);
+        break;
+    default:
+        break;
     }
-    return HST_RES_ERR;
+#undef HDR
+
+    if (psz == NULL || 0 != tok_cmpi_strz(name, psz))
+        return HST_HDR_OTHER;
+    return id;
 }
 
 
-// Parse http headers.
-static int _hst_parse_headers(void) {
-    int i, linelen, ret = HST_RES_ERR;
-    buf_t *buf = &me.hbuf;
+/* Parse request line.
+ *
+ * Input:
+ *      line - line start
+ *      sp1, sp2 - first and second space in line
+ *      cr - end of line, at CR
+ */
+static int _hst_parse_req_line(hst_ctx_t *ctx, conn_t *c, const char *line,
+                               const char *sp1, const char *sp2,
+                               const char *cr) {
+    int i, ret = HST_RES_BADREQUEST;
+    hst_req_t *req = c->req;
     char *p;
 
-    tok_t tok1, tok2;
-    int ts, te;         // token start index, token end index
-
-    // get first line - it is a request line
-    linelen = _hst_line_get(&me.hbuf);
-    if (linelen <= 0) goto exit;
+    tok_t tok1;
 
     // get method token
-    for (ts=te=buf->sta; ; te++) {
-        if (buf->buf[te] == '\r') goto exit;
-        if (buf->buf[te] == ' ') break;
-    }
-    tok1.ptr = buf->buf + ts;
-    tok1.len = te - ts;
+    tok1.ptr = line;
+    tok1.len = (int)(sp1 - tok1.ptr);
 
     // parse method type
     if (0 == tok_cmp_strz(&tok1, "GET")) {
-        me.req->method_get = true;
+        req->method_get = true;
     } else if (0 == tok_cmp_strz(&tok1, "POST")) {
-        me.req->method_post = true;
+        req->method_post = true;
     } else if (0 == tok_cmp_strz(&tok1, "HEAD")) {
-        me.req->method_head = true;
+        req->method_head = true;
     } else {
         goto exit;
     }
 
     // get request-target
-    te++;
-    for (ts=te; ; te++) {
-        if (buf->buf[te] == '\r') goto exit;
-        if (buf->buf[te] == ' ') break;
-    }
-    tok1.ptr = buf->buf + ts;
-    tok1.len = te - ts;
-    p = _hst_create_strz(tok1.ptr, tok1.len);
-    if (!p) goto exit;
-    me.req->request_target = p;
-
-    // parse path part of request-target
-    hst_path_elt_t **last_path_elt = &me.req->path_elt_first;
+    tok1.ptr = sp1 + 1;
+    tok1.len = (int)(sp2 - tok1.ptr);
+    p = _hst_create_strz(&c->mem, tok1.ptr, tok1.len);
+    if (!p) goto einternal;
+    req->request_target = p;
+
+    // parse path part of request-target, views are added to array at the
+    // end of memory, which grows while nothing else is allocated
+    hst_path_elt_t **last_path_elt = &req->path_elt_first;
+    if (ctx->req_views)
+        req->path_views = mem_alloc(&c->mem, 0);
+    if (ctx->req_views && req->path_views == NULL)
+        goto einternal;
     if (*p && *p != '/')
         goto exit;
     for (p++,i=0; ; ) {
         bool slash = (p[i] == '/');
         bool end = (!p[i] || p[i] == '?');
-        if ((slash || end) && i) {
-            hst_path_elt_t *e = mem_alloc(sizeof(*e));
-            if (e == NULL) goto exit;
+        if ((slash || end) && i && ctx->req_views) {
+            req->path_views = mem_grow(&c->mem, req->path_views,
+                    req->path_views_num * (int)sizeof(hst_view_t),
+                    sizeof(hst_view_t), false);
+            if (req->path_views == NULL)
+                goto einternal;
+            hst_view_t *v = &req->path_views[req->path_views_num++];
+            v->ptr = p;
+            v->len = i;
+        } else if ((slash || end) && i) {
+            hst_path_elt_t *e = mem_alloc(&c->mem, sizeof(*e));
+            if (e == NULL) goto einternal;
             memset(e, 0, sizeof(*e));
-            e->name = _hst_create_strz(p, i);
-            if (e->name == NULL) goto exit;
+            e->name = _hst_create_strz(&c->mem, p, i);
+            if (e->name == NULL) goto einternal;
             *last_path_elt = e;
             last_path_elt = &e->next;
         }
@@ -568,646 +1386,3433 @@ static int _hst_parse_headers(void) {
         i++;
     }
 
-    // todo: parse query part of request-target
+    // query part of request-target is parsed on demand by hst_req_query()
 
-    // todo: parse http version
+    // parse http version
+    tok1.ptr = sp2 + 1;
+    tok1.len = (int)(cr - tok1.ptr);
+    if (0 == tok_cmp_strz(&tok1, "HTTP/1.0")) {
+        c->http_1_0 = true;
+    } else if (tok1.len != 8 || 0 != strncmp(tok1.ptr, "HTTP/1.", 7)) {
+        goto exit;
+    }
 
-    // parse headers
-    bool hdr_content_len = false;
-    bool hdr_transfer_enc = false;
-    hst_hdr_t **last_hdr = &me.req->hdr_first;
-    for (;;) {
-        // discard previous line
-        me.hbuf.sta += linelen;
+    // persistent connection is default since HTTP/1.1 (rfc7230 6.3)
+    c->keep_alive = !c->http_1_0;
 
-        // get new line
-        linelen = _hst_line_get(&me.hbuf);
-        if (linelen <= 0) goto exit;
+    // prepare for headers
+    c->last_hdr = &req->hdr_first;
+    if (ctx->req_views)
+        req->hdr_views = mem_alloc(&c->mem, 0);
+    if (ctx->req_views && req->hdr_views == NULL)
+        goto einternal;
 
-        // empty line is a sign of headers section end
-        if (linelen < 3) {
-            me.hbuf.sta += linelen;
-            break;
-        }
+    ret = HST_RES_OK;
 
-        // get header name
-        for (ts=te=buf->sta; ; te++) {
-            if (buf->buf[te] == '\r') goto exit;
-            if (buf->buf[te] == ':') break;
-        }
-        tok1.ptr = buf->buf + ts;
-        tok1.len = te - ts;
-        if (tok1.len == 0) goto exit;
+exit:
+    return ret;
+
+einternal:
+    ret = HST_RES_INTERNAL;
+    goto exit;
+}
 
-        // get header value
-        for (ts=te+1; ; ts++)  // skip white space
-            if (buf->buf[ts] != ' ' && buf->buf[ts] != '\t')
-                break;
-        for (te=ts; ; te++)  // value token
-            if (buf->buf[te] == '\r')
-                break;
-        tok2.ptr = buf->buf + ts;
-        tok2.len = te - ts;
-        if (tok2.len == 0) goto exit;
 
+/* Parse header line.
+ *
+ * Input:
+ *      p - line start
+ *      colon - first colon in line
+ *      cr - end of line, at CR
+ */
+static int _hst_parse_hdr_line(hst_ctx_t *ctx, conn_t *c, const char *p,
+                               const char *colon, const char *cr) {
+    hst_req_t *req = c->req;
+    const char *t;
+
+    tok_t tok1, tok2;
+
+    // get header name
+    tok1.ptr = p;
+    tok1.len = (int)(colon - tok1.ptr);
+    if (tok1.len == 0) return HST_RES_BADREQUEST;
+
+    // get header value
+    // skip white space
+    for (t = colon + 1; t < cr && (*t == ' ' || *t == '\t'); t++)
+        ;
+    tok2.ptr = t;
+    tok2.len = (int)(cr - tok2.ptr);
+    if (tok2.len == 0) return HST_RES_BADREQUEST;
+
+    hst_view_t value;
+    value.ptr = tok2.ptr;
+    value.len = tok2.len;
+    if (ctx->req_views) {
+        // add view of header to array, it points to headers buffer
+        req->hdr_views = mem_grow(&c->mem, req->hdr_views,
+                req->hdr_views_num * (int)sizeof(hst_hdr_view_t),
+                sizeof(hst_hdr_view_t), false);
+        if (req->hdr_views == NULL)
+            return HST_RES_INTERNAL;
+        hst_hdr_view_t *v = &req->hdr_views[req->hdr_views_num++];
+        v->name.ptr = tok1.ptr;
+        v->name.len = tok1.len;
+        v->value = value;
+    } else {
         // create header
-        hst_hdr_t *hdr = mem_alloc(sizeof(*hdr));
-        if (hdr == NULL) goto exit;
+        hst_hdr_t *hdr = mem_alloc(&c->mem, sizeof(*hdr));
+        if (hdr == NULL) return HST_RES_INTERNAL;
         hdr->next = NULL;
-        hdr->name = _hst_create_strz(tok1.ptr, tok1.len);
-        if (hdr->name == NULL) goto exit;
-        hdr->value = _hst_create_strz(tok2.ptr, tok2.len);
-        if (hdr->value == NULL) goto exit;
+        hdr->name = _hst_create_strz(&c->mem, tok1.ptr, tok1.len);
+        if (hdr->name == NULL) return HST_RES_INTERNAL;
+        hdr->value = _hst_create_strz(&c->mem, tok2.ptr, tok2.len);
+        if (hdr->value == NULL) return HST_RES_INTERNAL;
 
         // add header to request
-        *last_hdr = hdr;
-        last_hdr = &hdr->next;
+        *c->last_hdr = hdr;
+        c->last_hdr = &hdr->next;
+        value.ptr = hdr->value;
+    }
 
-        // handle 'Content-Length' header
-        if (0 == strcasecmp(hdr->name, "Content-Length")) {
-            hdr_content_len = true;
-            me.body_len = atoi(hdr->value);
-        }
+    // well-known header goes to its slot, first one is kept
+    hst_hdr_id_t id = _hst_hdr_id(&tok1);
+    if (id == HST_HDR_OTHER)
+        return HST_RES_OK;
+    if (req->hdr_known[id].ptr == NULL)
+        req->hdr_known[id] = value;
+
+    // handle 'Content-Length' header, value is followed by CR
+    if (id == HST_HDR_CONTENT_LENGTH) {
+        c->hdr_content_len = true;
+        c->body_len = atoi(tok2.ptr);
+        if (c->body_len < 0) return HST_RES_BADREQUEST;
+    }
 
-        // handle 'Transfer-Encoding' header
-        if (0 == strcasecmp(hdr->name, "Transfer-Encoding")) {
-            hdr_transfer_enc = true;
-            if (strstr(hdr->value, "chunked"))
-                me.body_chunked = 1;
-        }
+    // handle 'Transfer-Encoding' header
+    if (id == HST_HDR_TRANSFER_ENCODING) {
+        c->hdr_transfer_enc = true;
+        if (tok_list_has(&tok2, "chunked"))
+            c->body_chunked = 1;
     }
 
-    // If both 'Content-Length' and 'Transfer-Encoding' are set,
-    // then this is an error (rfc7230 3.3.3).
-    if (hdr_content_len && hdr_transfer_enc) {
-        ERROR("Length and chunked.");
-        ret = HST_RES_BADREQUEST;
+    // handle 'Connection' header
+    if (id == HST_HDR_CONNECTION) {
+        if (tok_list_has(&tok2, "close"))
+            c->keep_alive = false;
+        else if (tok_list_has(&tok2, "keep-alive"))
+            c->keep_alive = true;
+    }
+    return HST_RES_OK;
+}
+
+
+/* Parse complete lines of request line and headers section, which are
+ * read so far. Each line is scanned once for its delimiters (two spaces of
+ * request line or colon of header) and its end. Scanning stops at any byte
+ * and continues from the same place when more data is read, delimiters
+ * found so far are kept in connection. Request data stays in headers buffer
+ * from 'sta' until headers section is parsed, views point to it.
+ *
+ * Return:
+ *      HST_RES_OK - headers section is parsed, 'sta' is moved after it
+ *      HST_RES_CONT - more data needed
+ *      other - error
+ */
+static int _hst_parse_headers(hst_ctx_t *ctx, conn_t *c) {
+    int res;
+    buf_t *buf = &c->hbuf;
+    const char *end = buf->buf + buf->len;
+
+    for (;;) {
+        // search for next delimiter or end of line, from where previous
+        // search stopped
+        const char *p = buf->buf + c->line;
+        int delims = (c->parse == PARSE_REQ_LINE) ? 2 : 1;
+        char a = (c->delims == delims) ? '\r' :
+                 (c->parse == PARSE_REQ_LINE) ? ' ' : ':';
+        const char *t = scan(buf->buf + c->scan, end, a);
+        if (t == end || (*t == '\r' && t + 1 == end)) {
+            c->scan = (int)(t - buf->buf);
+            if (buf->len - c->hdr_sta == buf->tot) {
+                ERROR("Line does not fit in buffer.");
+                return HST_RES_INTERNAL;
+            }
+            return HST_RES_CONT;
+        }
+        if (*t == a && a != '\r') {
+            c->delim[c->delims++] = (int)(t - buf->buf);
+            c->scan = (int)(t + 1 - buf->buf);
+            continue;
+        }
+
+        // line ends with CRLF, other control bytes are not allowed
+        if (*t != '\r' || t[1] != '\n')
+            return HST_RES_BADREQUEST;
+
+        if (c->parse == PARSE_REQ_LINE) {
+            if (c->delims != delims)
+                return HST_RES_BADREQUEST;
+            res = _hst_parse_req_line(ctx, c, p, buf->buf + c->delim[0],
+                                      buf->buf + c->delim[1], t);
+            c->parse = PARSE_HEADER;
+        } else if (t == p) {
+            // empty line is a sign of headers section end
+            break;
+        } else {
+            if (c->delims != delims)
+                return HST_RES_BADREQUEST;
+            res = _hst_parse_hdr_line(ctx, c, p, buf->buf + c->delim[0], t);
+        }
+        if (res != HST_RES_OK) return res;
+
+        c->line = c->scan = (int)(t + 2 - buf->buf);
+        c->delims = 0;
+    }
+
+    // If both 'Content-Length' and 'Transfer-Encoding' are set,
+    // then this is an error (rfc7230 3.3.3).
+    if (c->hdr_content_len && c->hdr_transfer_enc) {
+        ERROR("Length and chunked.");
+        return HST_RES_BADREQUEST;
+    }
+
+    // discard headers section
+    buf->sta = c->line + 2;
+    return HST_RES_OK;
+}
+
+
+// Value of hex digit or -1.
+static int _hst_hex_digit(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    ch |= 0x20;
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    return -1;
+}
+
+
+/* Decode chunked data. Decoder keeps its state in connection, so data may
+ * be passed in pieces of any size. Chunk extensions and trailer fields are
+ * skipped.
+ *
+ * Input:
+ *      c - client connection
+ *      src - coded data
+ *      len - length of coded data
+ *      used - receives number of coded bytes consumed
+ *      dst - buffer for chunks data, may be the same as 'src' since data
+ *            is never moved forward
+ *      max - size of 'dst' buffer
+ *      out - receives number of bytes put to 'dst'
+ * Return:
+ *      HST_RES_OK - last chunk and trailer are decoded
+ *      HST_RES_CONT - more data or space needed
+ *      HST_RES_BADREQUEST - malformed data
+ */
+static int _hst_chunked_parse(conn_t *c, const char *src, int len, int *used,
+                              char *dst, int max, int *out) {
+    int i = 0, o = 0, ret = HST_RES_CONT;
+
+    while (i < len && c->chunk_state != CH_DONE) {
+        char ch = src[i];
+
+        // chunk data is copied in one piece
+        if (c->chunk_state == CH_DATA) {
+            int n = len - i;
+            if (n > c->chunk_left) n = c->chunk_left;
+            if (n > max - o) n = max - o;
+            if (n == 0) break;
+            memmove(dst+o, src+i, (size_t)n);
+            o += n;
+            i += n;
+            c->chunk_left -= n;
+            if (c->chunk_left == 0)
+                c->chunk_state = CH_DATA_CR;
+            continue;
+        }
+
+        switch (c->chunk_state) {
+        case CH_SIZE: {
+            int d = _hst_hex_digit(ch);
+            if (d >= 0) {
+                int num = c->chunk_left < 0 ? 0 : c->chunk_left;
+                if (num > (INT_MAX - d) / 16) goto ebadrequest;
+                c->chunk_left = num*16 + d;
+            } else if (c->chunk_left < 0) {
+                goto ebadrequest;
+            } else if (ch == ';' || ch == ' ' || ch == '\t') {
+                c->chunk_state = CH_EXT;
+            } else if (ch == '\r') {
+                c->chunk_state = CH_SIZE_LF;
+            } else {
+                goto ebadrequest;
+            }
+            break;
+        }
+        case CH_EXT:
+            if (ch == '\r') c->chunk_state = CH_SIZE_LF;
+            else if (ch == '\n') goto ebadrequest;
+            break;
+        case CH_SIZE_LF:
+            if (ch != '\n') goto ebadrequest;
+            c->chunk_state = c->chunk_left ? CH_DATA : CH_TRAILER;
+            break;
+        case CH_DATA_CR:
+            if (ch != '\r') goto ebadrequest;
+            c->chunk_state = CH_DATA_LF;
+            break;
+        case CH_DATA_LF:
+            if (ch != '\n') goto ebadrequest;
+            c->chunk_state = CH_SIZE;
+            c->chunk_left = -1;
+            break;
+        case CH_TRAILER:
+            c->chunk_state = (ch == '\r') ? CH_END_LF : CH_TRAILER_LINE;
+            if (ch == '\n') goto ebadrequest;
+            break;
+        case CH_TRAILER_LINE:
+            if (ch == '\r') c->chunk_state = CH_TRAILER_LF;
+            else if (ch == '\n') goto ebadrequest;
+            break;
+        case CH_TRAILER_LF:
+            if (ch != '\n') goto ebadrequest;
+            c->chunk_state = CH_TRAILER;
+            break;
+        case CH_END_LF:
+            if (ch != '\n') goto ebadrequest;
+            c->chunk_state = CH_DONE;
+            break;
+        default:
+            goto ebadrequest;
+        }
+        i++;
+    }
+    if (c->chunk_state == CH_DONE)
+        ret = HST_RES_OK;
+
+exit:
+    *used = i;
+    *out = o;
+    return ret;
+
+ebadrequest:
+    ret = HST_RES_BADREQUEST;
+    goto exit;
+}
+
+
+/* Decode chunked request body read so far. Chunks data is moved in place
+ * over coded data before it, so body buffer keeps only decoded data and
+ * coded data is looked at once.
+ *
+ * Return:
+ *      HST_RES_OK - body is complete
+ *      HST_RES_CONT - more data needed
+ *      HST_RES_BADREQUEST - malformed body
+ */
+static int _hst_chunked_decode(conn_t *c) {
+    buf_t *buf = &c->bbuf;
+    char *p = buf->buf + c->chunk_pos;
+    int used, n;
+
+    int res = _hst_chunked_parse(c, p, buf->len - c->chunk_pos, &used,
+                                 p, buf->tot - c->chunk_pos, &n);
+    if (res == HST_RES_BADREQUEST) return res;
+
+    // data after body belongs to next request, return it to headers
+    // buffer after headers section, which may be referred by views
+    int rest = buf->len - c->chunk_pos - used;
+    if (rest > 0) {
+        buf_t *hbuf = &c->hbuf;
+        if (rest <= c->hdr_sta + hbuf->tot - hbuf->len) {
+            memcpy(hbuf->buf+hbuf->len, p+used, (size_t)rest);
+            hbuf->len += rest;
+        } else {
+            ERROR("No space for next request.");
+            c->keep_alive = false;
+        }
+    }
+
+    c->chunk_pos += n;
+    buf->len = c->chunk_pos;
+    return res;
+}
+
+
+static int _hst_uring_enter(uring_t *r, uint to_submit, uint min_complete,
+                            uint flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+
+// Return provided buffer to io_uring.
+static void _hst_uring_buf_put(uring_t *r, uint bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (UBUF_NUM-1)];
+    b->addr = (unsigned long)(r->bufs + bid*UBUF_SIZE);
+    b->len = UBUF_SIZE;
+    b->bid = (unsigned short)bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, (unsigned short)r->br_tail,
+                     __ATOMIC_RELEASE);
+}
+
+
+static void _hst_uring_deinit(uring_t *r) {
+    if (r->fd != -1)
+        close(r->fd);
+    if (r->sqes)
+        munmap(r->sqes, r->sq_entries*sizeof(*r->sqes));
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->br)
+        munmap(r->br, UBUF_NUM*sizeof(struct io_uring_buf));
+    free(r->bufs);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+
+/* Create io_uring with ring of provided buffers.
+ * Fails without error reporting if kernel lacks needed features.
+ */
+static int _hst_uring_init(uring_t *r, uint entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        goto error;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+            !(p.features & IORING_FEAT_NODROP))
+        goto error;
+
+    // map rings
+    r->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(uint);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(*r->cqes);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto error;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto error;
+        }
+    }
+    r->sq_entries = p.sq_entries;
+    r->sqes = mmap(NULL, p.sq_entries*sizeof(*r->sqes), PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto error;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_khead = (uint *)(sq + p.sq_off.head);
+    r->sq_ktail = (uint *)(sq + p.sq_off.tail);
+    r->sq_mask = *(uint *)(sq + p.sq_off.ring_mask);
+    r->cq_khead = (uint *)(cq + p.cq_off.head);
+    r->cq_ktail = (uint *)(cq + p.cq_off.tail);
+    r->cq_mask = *(uint *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_tail = *r->sq_ktail;
+
+    // submission entries are always used in ring order
+    uint *array = (uint *)(sq + p.sq_off.array);
+    for (uint i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    // register ring of provided buffers
+    r->br = mmap(NULL, UBUF_NUM*sizeof(struct io_uring_buf),
+                 PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        goto error;
+    }
+    r->bufs = malloc(UBUF_NUM*UBUF_SIZE);
+    if (r->bufs == NULL)
+        goto error;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->br;
+    reg.ring_entries = UBUF_NUM;
+    reg.bgid = 0;
+    int res = (int)syscall(__NR_io_uring_register, r->fd,
+                           IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (res != 0)
+        goto error;
+    for (uint i = 0; i < UBUF_NUM; i++)
+        _hst_uring_buf_put(r, i);
+
+    return HST_RES_OK;
+
+error:
+    _hst_uring_deinit(r);
+    return HST_RES_ERR;
+}
+
+
+// Submit prepared entries without waiting for completions.
+static int _hst_uring_submit(uring_t *r) {
+    while (r->to_submit) {
+        int res = _hst_uring_enter(r, r->to_submit, 0, 0, NULL, 0);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            ERROR("%s.", strerror(errno));
+            return HST_RES_ERR;
+        }
+        r->to_submit -= (uint)res;
+        if (res == 0) break;
+    }
+    return HST_RES_OK;
+}
+
+
+// Get zeroed submission entry. It is submitted on next wait for completions.
+static struct io_uring_sqe *_hst_uring_sqe(uring_t *r) {
+    uint head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+    if (r->sq_tail - head >= r->sq_entries) {
+        _hst_uring_submit(r);
+        head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+        if (r->sq_tail - head >= r->sq_entries) {
+            ERROR("Submission queue is full.");
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_tail++;
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+
+// User data of submission entry identifies connection and its generation,
+// so completions for already closed connections are recognised.
+static inline __u64 _hst_uring_udata(hst_ctx_t *ctx, conn_t *c, int op) {
+    __u64 idx = c ? (__u64)(c - ctx->conns) : 0;
+    __u64 gen = c ? (c->gen & 0xffffff) : 0;
+    return idx << 32 | gen << 8 | (__u64)op;
+}
+
+
+// Submit multishot accept on listening socket.
+static int _hst_uring_accept(hst_ctx_t *ctx) {
+    struct io_uring_sqe *sqe = _hst_uring_sqe(&ctx->ring);
+    if (sqe == NULL) return HST_RES_ERR;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ctx->ss;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = _hst_uring_udata(ctx, NULL, UOP_ACCEPT);
+    return HST_RES_OK;
+}
+
+
+// Submit receive of up to 'num' bytes to provided buffer.
+static int _hst_uring_recv(hst_ctx_t *ctx, conn_t *c, int num) {
+    struct io_uring_sqe *sqe = _hst_uring_sqe(&ctx->ring);
+    if (sqe == NULL) return HST_RES_ERR;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->sd;
+    sqe->len = (uint)(num < UBUF_SIZE ? num : UBUF_SIZE);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = _hst_uring_udata(ctx, c, UOP_RECV);
+    c->rd_pending = true;
+    return HST_RES_OK;
+}
+
+
+// Submit send of data gathered in connection's io vector.
+static int _hst_uring_send(hst_ctx_t *ctx, conn_t *c, int iovcnt) {
+    struct io_uring_sqe *sqe = _hst_uring_sqe(&ctx->ring);
+    if (sqe == NULL) return HST_RES_ERR;
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = (size_t)iovcnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->sd;
+    sqe->addr = (unsigned long)&c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = _hst_uring_udata(ctx, c, UOP_SEND);
+    c->wr_pending = true;
+    return HST_RES_OK;
+}
+
+
+// Submit wait for socket to be ready for sending.
+static int _hst_uring_pollout(hst_ctx_t *ctx, conn_t *c) {
+    struct io_uring_sqe *sqe = _hst_uring_sqe(&ctx->ring);
+    if (sqe == NULL) return HST_RES_ERR;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->sd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = _hst_uring_udata(ctx, c, UOP_POLLOUT);
+    c->wr_pending = true;
+    return HST_RES_OK;
+}
+
+
+// Submit poll for hang up of client, while reply is deferred.
+static int _hst_uring_pollhup(hst_ctx_t *ctx, conn_t *c) {
+    struct io_uring_sqe *sqe = _hst_uring_sqe(&ctx->ring);
+    if (sqe == NULL) return HST_RES_ERR;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->sd;
+    sqe->poll32_events = POLLRDHUP;
+    sqe->user_data = _hst_uring_udata(ctx, c, UOP_POLLHUP);
+    c->hup_pending = true;
+    return HST_RES_OK;
+}
+
+
+// Submit read of wake up counter, it completes when instance is woken.
+static int _hst_uring_wake(hst_ctx_t *ctx) {
+    struct io_uring_sqe *sqe = _hst_uring_sqe(&ctx->ring);
+    if (sqe == NULL) return HST_RES_ERR;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ctx->wake_fd;
+    sqe->addr = (unsigned long)&ctx->wake_cnt;
+    sqe->len = sizeof(ctx->wake_cnt);
+    sqe->user_data = _hst_uring_udata(ctx, NULL, UOP_WAKE);
+    return HST_RES_OK;
+}
+
+/* Get buffer to receive data to, according to connection state.
+ *
+ * Input:
+ *      c - client connection
+ *      num - receives number of bytes that can be added to buffer
+ * Return:
+ *      ptr to buffer or NULL if there is no space
+ */
+static buf_t *_hst_conn_rd_buf(conn_t *c, int *num) {
+    buf_t *buf;
+
+    if (c->state == CONN_RD_HEAD || c->state == CONN_RD_STREAM) {
+        // read as much as fits, body data read together with headers
+        // is passed to body buffer by _hst_conn_body_begin() or left to
+        // hst_read_body(); space of mirrored buffer continues after its end
+        buf = &c->hbuf;
+        *num = c->hdr_sta + buf->tot - buf->len;
+        if (*num <= 0) {
+            ERROR("No space in buffer.");
+            return NULL;
+        }
+        return buf;
+    } else if (c->state == CONN_RD_BODY) {
+        buf = &c->bbuf;
+        *num = c->body_len - c->bbuf.len;
+    } else if (c->state == CONN_RD_CHUNKED) {
+        buf = &c->bbuf;
+        if (buf->tot - buf->len < BREAD_SIZE &&
+                HST_RES_OK != buf_try_grow(buf, BREAD_SIZE) &&
+                buf->len == buf->tot)
+            return NULL;
+        *num = buf->tot - buf->len;
+    } else {
+        return NULL;
+    }
+
+    // check size
+    if (*num > buf->tot - buf->len) {
+        buf_shift(buf);
+        if (*num > buf->tot - buf->len) {
+            *num = buf->tot - buf->len;
+            if (*num <= 0) {
+                ERROR("No space in buffer.");
+                return NULL;
+            }
+        }
+    }
+    return buf;
+}
+
+
+/* Gather reply data that is not sent yet.
+ *
+ * Input:
+ *      c - client connection
+ *      iov - receives up to 2 segments of data
+ * Return:
+ *      number of segments, 0 if all data is sent
+ */
+static int _hst_conn_iov(conn_t *c, struct iovec *iov) {
+    int n = 0;
+    int off = c->wr_off;
+    if (off < c->obuf.len) {
+        iov[n].iov_base = c->obuf.buf + off;
+        iov[n].iov_len = (size_t)(c->obuf.len - off);
+        n++;
+        off = 0;
+    } else {
+        off -= c->obuf.len;
+    }
+    if (c->out_body && off < c->bbuf.len) {
+        iov[n].iov_base = c->bbuf.buf + off;
+        iov[n].iov_len = (size_t)(c->bbuf.len - off);
+        n++;
+    }
+    return n;
+}
+
+
+// Connection is in one of states, in which data is read from client.
+static inline bool _hst_conn_reading(conn_t *c) {
+    return c->state == CONN_RD_HEAD || c->state == CONN_RD_BODY ||
+           c->state == CONN_RD_CHUNKED || c->state == CONN_RD_STREAM;
+}
+
+
+// Register connection in epoll for events needed in its current state.
+// With io_uring, submit receive or send instead; HST_RES_INTERNAL is
+// returned, if there is no memory to receive more body data.
+static int _hst_conn_watch(hst_ctx_t *ctx, conn_t *c) {
+    uint events = 0;
+
+    if (ctx->ring.fd != -1) {
+        if (c->state == CONN_DEFERRED)
+            return c->hup_pending ? HST_RES_OK : _hst_uring_pollhup(ctx, c);
+
+        // reply is sent before next data is received
+        bool rd = _hst_conn_reading(c);
+        if (!rd && c->state != CONN_WRITE)
+            return HST_RES_OK;
+        int len = _hst_conn_iov(c, c->iov);
+        if (len) {
+            if (!c->wr_pending)
+                return _hst_uring_send(ctx, c, len);
+        } else if (c->out_fd != -1) {
+            if (!c->wr_pending)
+                return _hst_uring_pollout(ctx, c);
+        } else if (rd && !c->rd_pending) {
+            // buffers are taken when data is received
+            if (c->hbuf.buf == NULL)
+                len = UBUF_SIZE;
+            else if (_hst_conn_rd_buf(c, &len) == NULL)
+                return HST_RES_INTERNAL;
+            return _hst_uring_recv(ctx, c, len);
+        }
+        return HST_RES_OK;
+    }
+
+    if (_hst_conn_reading(c)) {
+        events = EPOLLIN;
+        if (c->obuf.len || c->out_body || c->out_fd != -1)
+            events |= EPOLLOUT;
+    } else if (c->state == CONN_WRITE) {
+        events = EPOLLOUT;
+    } else if (c->state == CONN_DEFERRED) {
+        events = EPOLLRDHUP;
+    }
+
+    if (c->events == events)
+        return HST_RES_OK;
+
+    int op = EPOLL_CTL_MOD;
+    if (events == 0) op = EPOLL_CTL_DEL;
+    else if (c->events == 0) op = EPOLL_CTL_ADD;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    int res = epoll_ctl(ctx->epfd, op, c->sd, &ev);
+    if (res == -1) {
+        ERROR("%s.", strerror(errno));
+        return HST_RES_ERR;
+    }
+    c->events = events;
+    return HST_RES_OK;
+}
+
+
+// Remove connection from timer wheel.
+static void _hst_timer_del(conn_t *c) {
+    if (c->tpprev == NULL)
+        return;
+    *c->tpprev = c->tnext;
+    if (c->tnext)
+        c->tnext->tpprev = c->tpprev;
+    c->tnext = NULL;
+    c->tpprev = NULL;
+}
+
+
+// Set connection deadline 'timeout' seconds from now.
+static void _hst_timer_set(hst_ctx_t *ctx, conn_t *c, int timeout) {
+    _hst_timer_del(c);
+    c->deadline = ctx->now + timeout;
+    if (c->deadline <= ctx->expired)
+        c->deadline = ctx->expired + 1;
+
+    conn_t **slot = &ctx->wheel[c->deadline & (WHEEL_SIZE-1)];
+    c->tnext = *slot;
+    if (c->tnext)
+        c->tnext->tpprev = &c->tnext;
+    c->tpprev = slot;
+    *slot = c;
+}
+
+
+static void _hst_conn_init(conn_t *c) {
+    c->requests = 0;
+    c->wr_off = 0;
+    c->out_body = false;
+}
+
+
+static int _hst_conn_req_new(conn_t *c) {
+    c->req = mem_alloc(&c->mem, sizeof(*c->req));
+    if (c->req == NULL) return HST_RES_ERR;
+    memset(c->req, 0, sizeof(*c->req));
+    c->req->mem = &c->mem;
+    return HST_RES_OK;
+}
+
+
+/* Take buffers when data of connection arrives. Connection waiting for
+ * request, which has no data read and no reply to send, gives them back
+ * by _hst_conn_release(), so idle connection holds no memory. Mirrored
+ * headers buffers are kept by instance for reuse, other buffers are
+ * in connection memory, blocks of which are returned to pool.
+ */
+static int _hst_conn_acquire(hst_ctx_t *ctx, conn_t *c) {
+    int res;
+
+    if (ctx->hbufs_num) {
+        c->hbuf = ctx->hbufs[--ctx->hbufs_num];
+    } else if (ctx->mirror &&
+               HST_RES_OK != buf_mirror_init(&c->hbuf, HBUF_SIZE)) {
+        ctx->mirror = false;  // arena buffers are used
+    }
+    if (!c->hbuf.mirror) {
+        res = buf_alloc(&c->hbuf, &c->mem, HBUF_SIZE);
+        if (res != HST_RES_OK) return HST_RES_ERR;
+    }
+    res = buf_alloc(&c->obuf, &c->mem, OBUF_SIZE);
+    if (res != HST_RES_OK) return HST_RES_ERR;
+    c->checkpoint = mem_checkpoint_get(&c->mem);
+    c->hdr_sta = c->line = c->scan = 0;
+    c->delims = 0;
+    return _hst_conn_req_new(c);
+}
+
+
+static void _hst_conn_release(hst_ctx_t *ctx, conn_t *c) {
+    if (c->hbuf.mirror) {
+        c->hbuf.sta = c->hbuf.len = 0;
+        ctx->hbufs[ctx->hbufs_num++] = c->hbuf;
+    }
+    memset(&c->hbuf, 0, sizeof(c->hbuf));
+    memset(&c->obuf, 0, sizeof(c->obuf));
+    memset(&c->bbuf, 0, sizeof(c->bbuf));
+    mem_checkpoint_restore(&c->mem, 0);
+    c->req = NULL;
+}
+
+
+// Close socket of client connection, its memory is not released.
+static void _hst_conn_shut(hst_ctx_t *ctx, conn_t *c) {
+    // entries for this socket must not be submitted after descriptor
+    // is closed and possibly reused
+    if (ctx->ring.to_submit)
+        _hst_uring_submit(&ctx->ring);
+
+    if (c->sd != -1) {
+        shutdown(c->sd, SHUT_RDWR);
+        close(c->sd);  // also removes socket from epoll set
+    }
+    c->sd = -1;
+    _hst_timer_del(c);
+    if (c->out_fd != -1)
+        close(c->out_fd);
+    c->out_fd = -1;
+    c->events = 0;
+    c->rd_pending = false;
+    c->wr_pending = false;
+    c->hup_pending = false;
+}
+
+
+// Close client connection and return it to free list.
+static void _hst_conn_close(hst_ctx_t *ctx, conn_t *c) {
+    _hst_conn_shut(ctx, c);
+    c->gen++;
+    _hst_conn_release(ctx, c);
+    c->state = CONN_FREE;
+    c->next = ctx->conn_free;
+    ctx->conn_free = c;
+}
+
+
+// Close connection of deferred request, as client does not wait for reply
+// any more. Request stays valid until application resumes it.
+static void _hst_conn_drop(hst_ctx_t *ctx, conn_t *c) {
+    _hst_conn_shut(ctx, c);
+    c->state = CONN_CLOSED;
+}
+
+
+// Prepare connection for reading new request.
+// Data of new request, which is already read, is kept in headers buffer.
+// Persistent connection waiting for next request is 'idle' until its
+// first data arrives, then headers are to be read in limited time.
+static int _hst_conn_start(hst_ctx_t *ctx, conn_t *c, bool idle) {
+    memset(&c->bbuf, 0, sizeof(c->bbuf));
+    if (c->hbuf.buf) {
+        mem_checkpoint_restore(&c->mem, c->checkpoint);
+        buf_shift(&c->hbuf);
+        if (HST_RES_OK != _hst_conn_req_new(c)) return HST_RES_ERR;
+    }
+
+    c->state = CONN_RD_HEAD;
+    c->parse = PARSE_REQ_LINE;
+    c->hdr_sta = c->line = c->scan = c->hbuf.sta;
+    c->delims = 0;
+    c->hdr_content_len = false;
+    c->hdr_transfer_enc = false;
+    c->body_len = 0;
+    c->body_chunked = 0;
+    c->chunk_pos = 0;
+    c->chunk_state = CH_SIZE;
+    c->chunk_left = -1;
+    c->body_stream = false;
+    c->body_err = false;
+    c->mpart = NULL;
+    c->keep_alive = false;
+    c->http_1_0 = false;
+    c->idle = idle && c->hbuf.len == c->hbuf.sta;
+    _hst_timer_set(ctx, c, c->idle ? ctx->keepalive_timeout
+                                   : ctx->header_timeout);
+    return HST_RES_OK;
+}
+
+
+// Set up connection for accepted nonblocking client socket.
+static void _hst_conn_new(hst_ctx_t *ctx, int sd) {
+    int res;
+
+    conn_t *c = ctx->conn_free;
+    if (c == NULL) {
+        ERROR("Too many connections.");
+        close(sd);
+        return;
+    }
+
+    // memory is allocated on first use of connection object
+    if (c->mem.pool == NULL) {
+        res = mem_init(&c->mem, &ctx->pool, ctx->conn_mem);
+        if (res != HST_RES_OK) {
+            close(sd);
+            return;
+        }
+    }
+
+    ctx->conn_free = c->next;
+    c->next = NULL;
+    c->sd = sd;
+    c->events = 0;
+    _hst_conn_init(c);
+    res = _hst_conn_start(ctx, c, false);
+    if (res == HST_RES_OK)
+        res = _hst_conn_watch(ctx, c);
+    if (res != HST_RES_OK)
+        _hst_conn_close(ctx, c);
+}
+
+
+// Accept pending client connections.
+static void _hst_accept(hst_ctx_t *ctx) {
+    for (;;) {
+        int sd = accept4(ctx->ss, NULL, 0, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (sd == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ERROR("%s.", strerror(errno));
+            return;
+        }
+
+        _hst_conn_new(ctx, sd);
+    }
+}
+
+
+// Send error reply for request that was not handed to application.
+static void _hst_conn_reply_error(hst_ctx_t *ctx, conn_t *c, int ret) {
+    c->keep_alive = false;
+    ctx->conn = c;
+    ctx->state = STATE_WR_RES;
+    if (ret == HST_RES_BADREQUEST) {
+        hst_write_res(ctx, 400, "Bad request");
+        hst_write_end(ctx);
+    } else if (ret == HST_RES_INTERNAL) {
+        hst_write_res(ctx, 500, "Internal server error.");
+        hst_write_end(ctx);
+    } else {
+        _hst_conn_close(ctx, c);
+        ctx->state = STATE_READ;
+        ctx->conn = NULL;
+    }
+}
+
+
+// Put request to queue of requests to be handed to application.
+static int _hst_conn_queue(hst_ctx_t *ctx, conn_t *c) {
+    // stop watching socket and timer until reply is written
+    _hst_timer_del(c);
+    c->state = CONN_READY;
+    int res = _hst_conn_watch(ctx, c);
+    if (res != HST_RES_OK) return res;
+
+    c->next = NULL;
+    if (ctx->ready_last)
+        ctx->ready_last->next = c;
+    else
+        ctx->ready_first = c;
+    ctx->ready_last = c;
+    return HST_RES_OK;
+}
+
+
+// Request is read completely, put it to queue of ready requests.
+static int _hst_conn_ready(hst_ctx_t *ctx, conn_t *c) {
+    if (++c->requests >= ctx->keepalive_max)
+        c->keep_alive = false;
+
+    if (c->bbuf.buf) {
+        int zero = 0;
+        int res = buf_add(&c->bbuf, &zero, 1);
+        if (res != HST_RES_OK) return HST_RES_INTERNAL;
+        c->req->body = c->bbuf.buf;
+        c->req->body_len = c->bbuf.len - 1;  // zero not included
+    }
+    return _hst_conn_queue(ctx, c);
+}
+
+
+// Streamed body can not be read, request is handed to application to
+// finish it, hst_read_body() fails then.
+static void _hst_conn_body_fail(hst_ctx_t *ctx, conn_t *c) {
+    c->body_err = true;
+    if (HST_RES_OK != _hst_conn_queue(ctx, c))
+        _hst_conn_close(ctx, c);
+}
+
+
+// Headers are parsed, prepare for reading request body.
+// Body data, which is read together with headers, is moved to body buffer
+// once. If it is the whole body and nothing follows it, then body buffer
+// refers to it in headers buffer without copying.
+static int _hst_conn_body_begin(conn_t *c) {
+    int res;
+    buf_t *hbuf = &c->hbuf;
+    int n = hbuf->len - hbuf->sta;
+
+    if (c->body_len && n == c->body_len &&
+            hbuf->len < c->hdr_sta + hbuf->tot) {
+        // space for terminating zero is left after body
+        c->bbuf.buf = hbuf->buf + hbuf->sta;
+        c->bbuf.mem = &c->mem;
+        c->bbuf.tot = n + 1;
+        c->bbuf.len = n;
+        c->bbuf.sta = 0;
+        hbuf->sta = hbuf->len;
+        c->state = CONN_RD_BODY;
+        return HST_RES_OK;
+    }
+
+    if (c->body_len) {  // size is known, space for terminating zero is added
+        res = buf_alloc(&c->bbuf, &c->mem, c->body_len + 1);
+        if (res != HST_RES_OK) return HST_RES_INTERNAL;
+        c->state = CONN_RD_BODY;
+    } else if (c->body_chunked) {  // chunked transfer is used
+        res = buf_alloc(&c->bbuf, &c->mem, n > BREAD_SIZE ? n : BREAD_SIZE);
+        if (res != HST_RES_OK) return HST_RES_INTERNAL;
+        c->state = CONN_RD_CHUNKED;
+    } else {
+        return HST_RES_OK;
+    }
+
+    // copy from header buffer, data after body stays there
+    if (c->body_len && n > c->body_len) n = c->body_len;
+    if (n > 0) {
+        memcpy(c->bbuf.buf, hbuf->buf+hbuf->sta, (uint)n);
+        c->bbuf.len += n;
+        hbuf->sta += n;
+    }
+    return HST_RES_OK;
+}
+
+
+/* Advance request parsing using data that is already read.
+ *
+ * Return:
+ *      HST_RES_OK - request is read completely and queued
+ *      HST_RES_CONT - more data needed
+ *      other - error
+ */
+static int _hst_conn_parse(hst_ctx_t *ctx, conn_t *c) {
+    int res;
+
+    // data of streamed body is given to application by hst_read_body()
+    if (c->state == CONN_RD_STREAM)
+        return _hst_conn_queue(ctx, c);
+
+    if (c->state == CONN_RD_HEAD) {
+        res = _hst_parse_headers(ctx, c);
+        if (res != HST_RES_OK) return res;
+
+        // body is left to application, data of it read so far stays
+        // in headers buffer; it is read in the same limited time
+        if (ctx->body_stream && (c->body_len || c->body_chunked)) {
+            c->body_stream = true;
+            c->body_deadline = ctx->now + ctx->body_timeout;
+            c->hdr_end = c->hbuf.sta;
+            return _hst_conn_ready(ctx, c);
+        }
+
+        res = _hst_conn_body_begin(c);
+        if (res != HST_RES_OK) return res;
+        if (c->state != CONN_RD_HEAD)
+            _hst_timer_set(ctx, c, ctx->body_timeout);
+    }
+
+    // check if body is complete
+    if (c->state == CONN_RD_BODY) {
+        if (c->bbuf.len < c->body_len)
+            return HST_RES_CONT;
+    } else if (c->state == CONN_RD_CHUNKED) {
+        res = _hst_chunked_decode(c);
+        if (res != HST_RES_OK) return res;
+    }
+    return _hst_conn_ready(ctx, c);
+}
+
+
+/* Read available data from client and advance request parsing.
+ *
+ * Return:
+ *      HST_RES_OK - request is read completely and queued
+ *      HST_RES_CONT - more data needed
+ *      other - error
+ */
+static int _hst_conn_read(hst_ctx_t *ctx, conn_t *c) {
+    int num;
+    if (c->hbuf.buf == NULL && HST_RES_OK != _hst_conn_acquire(ctx, c))
+        return HST_RES_ERR;
+    buf_t *buf = _hst_conn_rd_buf(c, &num);
+    if (buf == NULL) return HST_RES_INTERNAL;
+
+    int res = _hst_buf_add(c, buf, num);
+    if (res <= 0) return res;
+
+    return _hst_conn_parse(ctx, c);
+}
+
+
+/* Send buffered reply data, which is not sent yet, without waiting.
+ *
+ * Return:
+ *      HST_RES_OK - all data is sent
+ *      HST_RES_CONT - socket is not ready to accept more data
+ *      HST_RES_ERR - error
+ */
+static int _hst_conn_sendmsg(conn_t *c) {
+    struct iovec iov[2];
+    int n;
+
+    while ( (n = _hst_conn_iov(c, iov)) ) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)n;
+        ssize_t s = sendmsg(c->sd, &msg, MSG_NOSIGNAL);
+        if (s < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return HST_RES_CONT;
+            ERROR("%s.", strerror(errno));
+            return HST_RES_ERR;
+        }
+        c->wr_off += (int)s;
+    }
+    return HST_RES_OK;
+}
+
+
+/* Send reply data that is not sent yet.
+ * With io_uring, data is not sent here but submitted by _hst_conn_watch().
+ *
+ * Return:
+ *      HST_RES_OK - all data is sent
+ *      HST_RES_CONT - socket is not ready to accept more data
+ *      HST_RES_ERR - error
+ */
+static int _hst_conn_send(hst_ctx_t *ctx, conn_t *c) {
+    struct iovec iov[2];
+
+    if (ctx->ring.fd != -1 && _hst_conn_iov(c, iov))
+        return HST_RES_CONT;
+    int res = _hst_conn_sendmsg(c);
+    if (res != HST_RES_OK) return res;
+
+    // body from file descriptor goes after all buffered data
+    while (c->out_fd != -1 && c->out_len > 0) {
+        ssize_t s;
+        if (c->out_pipe)
+            s = splice(c->out_fd, NULL, c->sd, NULL, (size_t)c->out_len,
+                       SPLICE_F_MOVE|SPLICE_F_MORE);
+        else
+            s = sendfile(c->sd, c->out_fd, &c->out_off, (size_t)c->out_len);
+        if (s < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return HST_RES_CONT;
+            ERROR("%s.", strerror(errno));
+            return HST_RES_ERR;
+        }
+        if (s == 0) {
+            ERROR("Unexpected end of file.");
+            return HST_RES_ERR;
+        }
+        c->out_len -= s;
+    }
+    if (c->out_fd != -1) {
+        close(c->out_fd);
+        c->out_fd = -1;
+    }
+
+    c->obuf.len = 0;
+    c->wr_off = 0;
+    c->out_body = false;
+    return HST_RES_OK;
+}
+
+
+/* Reply to current request is complete. Go on with next request.
+ *
+ * Replies to pipelined requests are collected in output buffer while
+ * next requests are already read, and sent together when there is no
+ * complete request left. Reply body that is not copied to output buffer
+ * and non-persistent connections are sent before doing anything else.
+ *
+ * Return:
+ *      HST_RES_OK - reply is sent or queued
+ *      HST_RES_ERR - reply could not be sent, connection is closed
+ */
+static int _hst_conn_next(hst_ctx_t *ctx, conn_t *c) {
+    int res;
+
+    // rest of body, which is not read by application, is not skipped
+    if (c->body_stream && (c->body_err || (c->body_chunked ?
+            c->chunk_state != CH_DONE : c->body_len != 0)))
+        c->keep_alive = false;
+
+    if (c->out_body || c->out_fd != -1 || !c->keep_alive ||
+            c->obuf.len > OBUF_FLUSH) {
+        res = _hst_conn_send(ctx, c);
+        if (res == HST_RES_CONT) {
+            c->state = CONN_WRITE;
+            _hst_timer_set(ctx, c, ctx->write_timeout);
+            if (HST_RES_OK != _hst_conn_watch(ctx, c)) {
+                _hst_conn_close(ctx, c);
+                return HST_RES_ERR;
+            }
+            return HST_RES_OK;
+        }
+        if (res != HST_RES_OK || !c->keep_alive) {
+            _hst_conn_close(ctx, c);
+            return res;
+        }
+    }
+
+    res = _hst_conn_start(ctx, c, true);
+    if (res != HST_RES_OK) {
+        _hst_conn_close(ctx, c);
+        return HST_RES_ERR;
+    }
+
+    res = _hst_conn_parse(ctx, c);
+    if (res == HST_RES_OK)  // next request is queued, reply is kept
+        return HST_RES_OK;
+    if (res != HST_RES_CONT) {
+        _hst_conn_reply_error(ctx, c, res);
+        return HST_RES_OK;
+    }
+
+    // wait for more data, send collected replies meanwhile
+    res = _hst_conn_send(ctx, c);
+    if (res == HST_RES_OK && c->idle)
+        _hst_conn_release(ctx, c);
+    if (res == HST_RES_ERR || HST_RES_OK != _hst_conn_watch(ctx, c)) {
+        _hst_conn_close(ctx, c);
+        return HST_RES_ERR;
+    }
+    return HST_RES_OK;
+}
+
+
+/* Handle result of sending reply data.
+ *
+ * Return:
+ *      HST_RES_OK - connection is still open and is in the same state
+ *      HST_RES_CONT - connection state is changed or connection is closed
+ */
+static int _hst_conn_write_done(hst_ctx_t *ctx, conn_t *c, int res) {
+    if (res == HST_RES_ERR) {
+        _hst_conn_close(ctx, c);
+        return HST_RES_CONT;
+    }
+    // write deadline is extended on progress, as reply may be big
+    if (c->state == CONN_WRITE)
+        _hst_timer_set(ctx, c, ctx->write_timeout);
+    if (res == HST_RES_OK && c->state == CONN_WRITE) {
+        _hst_conn_next(ctx, c);
+        return HST_RES_CONT;
+    }
+    if (res == HST_RES_OK && c->state == CONN_RD_HEAD && c->idle)
+        _hst_conn_release(ctx, c);
+    res = _hst_conn_watch(ctx, c);
+    if (res == HST_RES_INTERNAL) {
+        _hst_conn_reply_error(ctx, c, res);
+        return HST_RES_CONT;
+    }
+    if (res != HST_RES_OK) {
+        _hst_conn_close(ctx, c);
+        return HST_RES_CONT;
+    }
+    return HST_RES_OK;
+}
+
+
+// Handle result of reading request data.
+static void _hst_conn_read_done(hst_ctx_t *ctx, conn_t *c, int res) {
+    if (res == HST_RES_OK || res == HST_RES_CONT) {
+        // headers deadline is not extended on progress, so slow clients
+        // can not hold connection
+        if (c->idle && c->state == CONN_RD_HEAD &&
+                c->hbuf.len > c->hbuf.sta) {
+            c->idle = false;
+            _hst_timer_set(ctx, c, ctx->header_timeout);
+        }
+        if (res == HST_RES_OK)
+            return;
+        // body, which does not fit in memory, is answered as by epoll
+        res = _hst_conn_watch(ctx, c);
+        if (res == HST_RES_INTERNAL)
+            _hst_conn_reply_error(ctx, c, res);
+        else if (res != HST_RES_OK)
+            _hst_conn_close(ctx, c);
+        return;
+    }
+    if (c->state == CONN_RD_STREAM) {
+        _hst_conn_body_fail(ctx, c);
+        return;
+    }
+    if (res == HST_RES_DISCONNECT) {
+        if (c->state == CONN_RD_HEAD && c->hbuf.len == c->hbuf.sta) {
+            // client closed connection between requests
+            c->keep_alive = false;
+            _hst_conn_next(ctx, c);
+            return;
+        }
+        res = HST_RES_BADREQUEST;
+    }
+    _hst_conn_reply_error(ctx, c, res);
+}
+
+
+// Handle epoll events for client connection.
+static void _hst_conn_event(hst_ctx_t *ctx, conn_t *c, uint events) {
+    // client does not wait for deferred reply any more
+    if (c->state == CONN_DEFERRED) {
+        if (events & (EPOLLRDHUP|EPOLLERR|EPOLLHUP))
+            _hst_conn_drop(ctx, c);
+        return;
+    }
+
+    if (events & (EPOLLERR|EPOLLHUP) && !(events & EPOLLIN)) {
+        if (c->state == CONN_RD_STREAM)
+            _hst_conn_body_fail(ctx, c);
+        else
+            _hst_conn_close(ctx, c);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        int res = _hst_conn_send(ctx, c);
+        if (HST_RES_OK != _hst_conn_write_done(ctx, c, res))
+            return;
+    }
+
+    if (!(events & EPOLLIN) || !_hst_conn_reading(c))
+        return;
+
+    _hst_conn_read_done(ctx, c, _hst_conn_read(ctx, c));
+}
+
+
+// Handle io_uring completion.
+static void _hst_uring_complete(hst_ctx_t *ctx, struct io_uring_cqe *cqe) {
+    int op = (int)(cqe->user_data & 0xff);
+    uint gen = (uint)(cqe->user_data >> 8) & 0xffffff;
+    conn_t *c = &ctx->conns[cqe->user_data >> 32];
+    bool has_buf = (cqe->flags & IORING_CQE_F_BUFFER);
+    uint bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (op == UOP_WAKE) {
+        ctx->woken = true;
+        if (HST_RES_OK != _hst_uring_wake(ctx))
+            ERROR("Can not wait for wake up.");
+        return;
+    }
+
+    if (op == UOP_ACCEPT) {
+        if (cqe->res >= 0)
+            _hst_conn_new(ctx, cqe->res);
+        else if (cqe->res != -EAGAIN && cqe->res != -EINTR)
+            ERROR("%s.", strerror(-cqe->res));
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            _hst_uring_accept(ctx);
+        return;
+    }
+
+    // completion for closed connection
+    if (c->state == CONN_FREE || c->state == CONN_CLOSED ||
+            (c->gen & 0xffffff) != gen) {
+        if (has_buf)
+            _hst_uring_buf_put(&ctx->ring, bid);
+        return;
+    }
+
+    if (op == UOP_RECV) {
+        c->rd_pending = false;
+        int res;
+        if (cqe->res > 0) {
+            int num;
+            buf_t *buf;
+            if (c->hbuf.buf == NULL &&
+                    HST_RES_OK != _hst_conn_acquire(ctx, c)) {
+                res = HST_RES_ERR;
+            } else if ((buf = _hst_conn_rd_buf(c, &num)) == NULL ||
+                       num < cqe->res) {
+                res = HST_RES_INTERNAL;
+            } else {
+                memcpy(buf->buf+buf->len, ctx->ring.bufs + bid*UBUF_SIZE,
+                       (size_t)cqe->res);
+                buf->len += cqe->res;
+                res = _hst_conn_parse(ctx, c);
+            }
+        } else if (cqe->res == 0) {
+            res = HST_RES_DISCONNECT;
+        } else if (cqe->res == -ENOBUFS || cqe->res == -EAGAIN ||
+                   cqe->res == -EINTR) {
+            res = HST_RES_CONT;
+        } else {
+            res = HST_RES_ERR;
+        }
+        if (has_buf)
+            _hst_uring_buf_put(&ctx->ring, bid);
+        _hst_conn_read_done(ctx, c, res);
+    } else if (op == UOP_SEND || op == UOP_POLLOUT) {
+        c->wr_pending = false;
+        int res;
+        if (cqe->res >= 0) {
+            if (op == UOP_SEND)
+                c->wr_off += cqe->res;
+            res = _hst_conn_send(ctx, c);
+        } else if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+            res = HST_RES_CONT;
+        } else {
+            res = HST_RES_ERR;
+        }
+        _hst_conn_write_done(ctx, c, res);
+    } else if (op == UOP_POLLHUP) {
+        c->hup_pending = false;
+        if (c->state != CONN_DEFERRED)
+            return;
+        if (cqe->res < 0 || cqe->res & (POLLRDHUP|POLLERR|POLLHUP) ||
+                HST_RES_OK != _hst_conn_watch(ctx, c))
+            _hst_conn_drop(ctx, c);
+    }
+}
+
+
+/* Submit prepared entries, wait for completions and handle them.
+ *
+ * Return:
+ *      >= 0 - number of handled completions
+ *      HST_RES_CONT - interrupted by signal
+ *      HST_RES_ERR - error
+ */
+static int _hst_uring_poll(hst_ctx_t *ctx) {
+    uring_t *r = &ctx->ring;
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = 1;
+    ts.tv_nsec = 0;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG/8;
+    arg.ts = (unsigned long)&ts;
+
+    int res = _hst_uring_enter(r, r->to_submit, 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (res < 0) {
+        if (errno == EINTR) return HST_RES_CONT;
+        if (errno != ETIME) {
+            ERROR("%s.", strerror(errno));
+            return HST_RES_ERR;
+        }
+    } else {
+        r->to_submit -= (uint)res;
+    }
+    ctx->now = time(NULL);
+
+    int n = 0;
+    uint head = *r->cq_khead;
+    uint tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, n++) {
+        struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+        __atomic_store_n(r->cq_khead, head+1, __ATOMIC_RELEASE);
+        _hst_uring_complete(ctx, &cqe);
+    }
+    return n;
+}
+
+
+// Reset wake up counter after instance is woken.
+static void _hst_wake_clear(hst_ctx_t *ctx) {
+    uint64_t cnt;
+    if (read(ctx->wake_fd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+        ERROR("%s.", strerror(errno));
+    ctx->woken = true;
+}
+
+
+// Wake instance waiting for events, it may be called from any thread.
+static void _hst_wake(hst_ctx_t *ctx) {
+    uint64_t one = 1;
+    if (write(ctx->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        ERROR("%s.", strerror(errno));
+}
+
+
+/* Wait for epoll events and handle them.
+ *
+ * Return:
+ *      >= 0 - number of handled events
+ *      HST_RES_CONT - interrupted by signal
+ *      HST_RES_ERR - error
+ */
+static int _hst_epoll_poll(hst_ctx_t *ctx) {
+    struct epoll_event ev[EVENTS_MAX];
+    int n = epoll_wait(ctx->epfd, ev, EVENTS_MAX, 1000);
+    if (n == -1) {
+        if (errno == EINTR) return HST_RES_CONT;
+        ERROR("%s.", strerror(errno));
+        return HST_RES_ERR;
+    }
+    ctx->now = time(NULL);
+
+    for (int i = 0; i < n; i++) {
+        void *p = ev[i].data.ptr;
+        if (p == NULL)
+            _hst_accept(ctx);
+        else if (p == &ctx->wake_fd)
+            _hst_wake_clear(ctx);
+        else
+            _hst_conn_event(ctx, p, ev[i].events);
+    }
+    return n;
+}
+
+
+// Close connections whose deadlines passed. Only timer wheel slots for
+// seconds elapsed since last check are visited.
+static void _hst_conn_expire(hst_ctx_t *ctx) {
+    if (ctx->expired >= ctx->now) {
+        ctx->expired = ctx->now;  // clock may go backwards
+        return;
+    }
+
+    time_t t = ctx->expired + 1;
+    if (ctx->now - t >= WHEEL_SIZE)
+        t = ctx->now - WHEEL_SIZE + 1;
+    for (; t <= ctx->now; t++) {
+        conn_t **pc = &ctx->wheel[t & (WHEEL_SIZE-1)];
+        while (*pc) {
+            conn_t *c = *pc;
+            if (c->deadline > ctx->now)
+                pc = &c->tnext;
+            else if (c->state == CONN_RD_STREAM)
+                _hst_conn_body_fail(ctx, c);  // removes it from slot
+            else if (c->state == CONN_DEFERRED)
+                _hst_conn_drop(ctx, c);
+            else
+                _hst_conn_close(ctx, c);
+        }
+    }
+    ctx->expired = ctx->now;
+}
+
+
+/* Read data of current request from client socket without waiting.
+ *
+ * Return:
+ *      number of bytes read, HST_RES_CONT if there is no data or error code
+ */
+static int _hst_recv(conn_t *c, void *ptr, int num) {
+    for (;;) {
+        ssize_t s = recv(c->sd, ptr, (size_t)num, 0);
+        if (s > 0)
+            return (int)s;
+        if (s == 0) {
+            ERROR("Connection closed.");
+            return HST_RES_DISCONNECT;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return HST_RES_CONT;
+        ERROR("%s.", strerror(errno));
+        return HST_RES_ERR;
+    }
+}
+
+
+/* Send reply data of current request, while application is still writing
+ * it, as far as socket accepts it without waiting. Sent data is dropped
+ * from buffers, so their space is used again.
+ */
+static int _hst_conn_flush(conn_t *c) {
+    // io_uring send of previous replies still uses buffers
+    if (c->wr_pending)
+        return HST_RES_OK;
+    if (HST_RES_ERR == _hst_conn_sendmsg(c))
+        return HST_RES_ERR;
+
+    if (c->wr_off >= c->obuf.len) {
+        int off = c->wr_off - c->obuf.len;
+        c->bbuf.len -= off;
+        memmove(c->bbuf.buf, c->bbuf.buf+off, (size_t)c->bbuf.len);
+        c->obuf.len = 0;
+        c->res_sta = 0;
+        c->wr_off = 0;
+    }
+    return HST_RES_OK;
+}
+
+
+/* Queue data of chunked reply body. It is framed as chunks as big as fit
+ * in body buffer. Queued data is sent without waiting as far as client
+ * reads it, rest of it is sent from event loop after hst_write_end().
+ * Buffer grows while client is slower than application, reply fails when
+ * memory of connection is exhausted.
+ * HTTP/1.0 client gets raw data, end of body is marked by closing connection.
+ */
+static int _hst_write_chunk(hst_ctx_t *ctx, const char *ptr, int size) {
+    conn_t *c = ctx->conn;
+    buf_t *bbuf = &c->bbuf;
+
+    if (c->res_head)
+        return HST_RES_OK;
+
+    while (size > 0) {
+        int free = bbuf->tot - bbuf->len - CHUNK_LINE;
+        if (free < size) {
+            if (HST_RES_OK != _hst_conn_flush(c)) return HST_RES_ERR;
+            free = bbuf->tot - bbuf->len - CHUNK_LINE;
+        }
+        if (free < size && free < CHUNK_SIZE &&
+                HST_RES_OK == buf_try_grow(bbuf, CHUNK_SIZE))
+            free += CHUNK_SIZE;
+        if (free <= 0) {
+            ERROR("Client does not read reply.");
+            return HST_RES_ERR;
+        }
+
+        int n = (free < size) ? free : size;
+        if (!c->http_1_0) {
+            // size line follows CRLF of previous chunk
+            bbuf->len += snprintf(bbuf->buf+bbuf->len, CHUNK_LINE, "%s%x\r\n",
+                                  c->chunk_open ? "\r\n" : "", n);
+            c->chunk_open = true;
+        }
+        memcpy(bbuf->buf+bbuf->len, ptr, (size_t)n);
+        bbuf->len += n;
+        ptr += n;
+        size -= n;
+    }
+    return HST_RES_OK;
+}
+
+
+/* Queue end of chunked body. Queued data is sent from event loop like body
+ * of other replies, so worker is not blocked.
+ */
+static int _hst_write_chunk_end(hst_ctx_t *ctx) {
+    conn_t *c = ctx->conn;
+    buf_t *bbuf = &c->bbuf;
+    static const char crlf_last[] = "\r\n0\r\n\r\n";
+
+    if (c->http_1_0 || c->res_head)
+        return HST_RES_OK;
+
+    int skip = c->chunk_open ? 0 : 2;
+    int len = (int)sizeof(crlf_last) - 1 - skip;
+    if (bbuf->tot - bbuf->len < len && HST_RES_OK != _hst_conn_flush(c))
+        return HST_RES_ERR;
+    if (bbuf->tot - bbuf->len < len &&
+            HST_RES_OK != buf_try_grow(bbuf, len)) {
+        ERROR("Client does not read reply.");
+        return HST_RES_ERR;
+    }
+    memcpy(bbuf->buf+bbuf->len, crlf_last+skip, (size_t)len);
+    bbuf->len += len;
+    c->chunk_open = false;
+    return HST_RES_OK;
+}
+
+
+// Add 'Connection' header to reply if its absence has wrong meaning.
+static int _hst_write_hdr_connection(hst_ctx_t *ctx) {
+    conn_t *c = ctx->conn;
+    if (!c->keep_alive)
+        return buf_printf(&c->obuf, "Connection: close\r\n");
+    if (c->http_1_0)
+        return buf_printf(&c->obuf, "Connection: keep-alive\r\n");
+    return HST_RES_OK;
+}
+
+
+static int _hst_write_body_init(hst_ctx_t *ctx) {
+    if (ctx->state == STATE_WR_HDR) {
+        // allocate buffer for reply body
+        int res = buf_alloc(&ctx->conn->bbuf, &ctx->conn->mem, CHUNK_SIZE);
+        if (res != HST_RES_OK) goto exit;
+        ctx->state = STATE_WR_BODY;
+    }
+
+    if (ctx->state == STATE_WR_BODY ||
+            ctx->state == STATE_WR_BODY_CHUNKED)
+        return HST_RES_OK;
+
+exit:
+    return HST_RES_ERR;
+}
+
+
+static int _hst_write_body_begin_chunked(hst_ctx_t *ctx) {
+    conn_t *c = ctx->conn;
+    buf_t *obuf = &c->obuf;
+    buf_t *bbuf = &c->bbuf;
+    int ret;
+
+    if (c->http_1_0) {
+        // HTTP/1.0 has no chunked encoding, end of body is marked by close
+        c->keep_alive = false;
+        ret = buf_printf(obuf, "Connection: close\r\n\r\n");
+    } else {
+        ret = _hst_write_hdr_connection(ctx);
+        if (ret != HST_RES_OK) goto exit;
+        ret = buf_printf(obuf, "Transfer-Encoding: chunked\r\n\r\n");
+    }
+    if (ret != HST_RES_OK) goto exit;
+
+    // body collected so far is the first chunk, it is sent after headers
+    // and replies to previous requests
+    c->chunk_open = (!c->http_1_0 && !c->res_head && bbuf->len > 0);
+    if (c->chunk_open) {
+        ret = buf_printf(obuf, "%x\r\n", bbuf->len);
+        if (ret != HST_RES_OK) goto exit;
+    }
+    c->out_body = !c->res_head;
+    ctx->state = STATE_WR_BODY_CHUNKED;
+
+exit:
+    return ret;
+}
+
+
+/* Set internal state to STATE_WR_ERROR and send 500 reply.
+ * In case of errors, do as much as possible without error reporting.
+ */
+static void _hst_write_error(hst_ctx_t *ctx) {
+    if (ctx->state == STATE_WR_ERROR || ctx->conn == NULL)
+        return;
+
+    // replace reply with error and send it together with previous replies
+    conn_t *c = ctx->conn;
+    if (ctx->state != STATE_WR_BODY_CHUNKED && c->res_sta >= c->wr_off) {
+        c->obuf.len = c->res_sta;
+        if (HST_RES_OK == buf_printf(&c->obuf,
+                "HTTP/1.1 500 Internal server error\r\n\r\n")) {
+            send(c->sd, c->obuf.buf+c->wr_off, (size_t)(c->obuf.len-c->wr_off),
+                 MSG_NOSIGNAL);
+        }
+    }
+
+    _hst_conn_close(ctx, ctx->conn);
+    ctx->state = STATE_WR_ERROR;
+}
+
+
+hst_ctx_t *hst_init(hst_conf_t *conf) {
+    int res, ret = HST_RES_ERR;
+
+    hst_ctx_t *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        ERROR("Not enough memory.");
+        return NULL;
+    }
+
+    // set module configuration
+    hst_conf_t c;
+    if (conf) c = *conf;
+    else memset(&c, 0, sizeof(c));
+    if (!c.backlog) c.backlog = DFLT_CONF_BACKLOG;
+    if (!c.port) c.port = DFLT_CONF_PORT;
+    if (c.mem_total < DFLT_CONF_MEM_TOTAL) c.mem_total = DFLT_CONF_MEM_TOTAL;
+    if (c.max_conns <= 0) c.max_conns = DFLT_CONF_MAX_CONNS;
+    if (c.conn_mem < DFLT_CONF_CONN_MEM) c.conn_mem = DFLT_CONF_CONN_MEM;
+    if (c.keepalive_timeout <= 0) c.keepalive_timeout = DFLT_CONF_KEEPALIVE_TIMEOUT;
+    if (c.header_timeout <= 0) c.header_timeout = DFLT_CONF_HEADER_TIMEOUT;
+    if (c.body_timeout <= 0) c.body_timeout = DFLT_CONF_BODY_TIMEOUT;
+    if (c.write_timeout <= 0) c.write_timeout = DFLT_CONF_WRITE_TIMEOUT;
+    if (c.defer_timeout <= 0) c.defer_timeout = DFLT_CONF_DEFER_TIMEOUT;
+    if (c.keepalive_max <= 0) c.keepalive_max = DFLT_CONF_KEEPALIVE_MAX;
+
+    ctx->ss = -1;
+    ctx->epfd = -1;
+    ctx->wake_fd = -1;
+    ctx->ring.fd = -1;
+    scan_init();
+
+    // init memory allocator, memory of instance and first block of each
+    // connection may be mapped at once
+    mem_pool_init(&ctx->pool, MEM_BLOCK_SIZE);
+    int flags = (c.mem_huge_pages ? MEM_HUGE : 0) |
+                (c.mem_populate ? MEM_POPULATE : 0) |
+                (c.mem_lock ? MEM_LOCK : 0);
+    if (flags) {
+        int num = (c.mem_total + MEM_BLOCK_SIZE-1) / MEM_BLOCK_SIZE;
+        res = mem_pool_reserve(&ctx->pool, num + c.max_conns, flags);
+        if (res != HST_RES_OK) goto exit;
+    }
+    res = mem_init(&ctx->mem, &ctx->pool, c.mem_total);
+    if (res != HST_RES_OK) goto exit;
+
+    // allocate connection objects
+    ctx->conns = calloc((size_t)c.max_conns, sizeof(*ctx->conns));
+    if (ctx->conns == NULL) {
+        ERROR("Not enough memory.");
+        goto exit;
+    }
+    ctx->conns_num = c.max_conns;
+    ctx->hbufs = calloc((size_t)c.max_conns, sizeof(*ctx->hbufs));
+    if (ctx->hbufs == NULL) {
+        ERROR("Not enough memory.");
+        goto exit;
+    }
+    ctx->conn_mem = c.conn_mem;
+    ctx->keepalive_timeout = c.keepalive_timeout;
+    ctx->req_views = c.req_views;
+    ctx->body_stream = c.body_stream;
+    ctx->mirror = HBUF_SIZE % sysconf(_SC_PAGESIZE) == 0;
+    ctx->header_timeout = c.header_timeout;
+    ctx->body_timeout = c.body_timeout;
+    ctx->write_timeout = c.write_timeout;
+    ctx->defer_timeout = c.defer_timeout;
+    ctx->keepalive_max = c.keepalive_max;
+    for (int i = ctx->conns_num-1; i >= 0; i--) {
+        ctx->conns[i].sd = -1;
+        ctx->conns[i].out_fd = -1;
+        ctx->conns[i].next = ctx->conn_free;
+        ctx->conn_free = &ctx->conns[i];
+    }
+
+    ctx->ss = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (ctx->ss == -1) {
+        ERROR("%s.", strerror(errno));
+        goto exit;
+    }
+    int yes = 1;
+    res = setsockopt(ctx->ss, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes));
+    if (res == -1) {
+        ERROR("%s.", strerror(errno));
+        goto exit;
+    }
+    if (c.reuse_port) {
+        res = setsockopt(ctx->ss, SOL_SOCKET, SO_REUSEPORT, (char*)&yes,
+                         sizeof(yes));
+        if (res == -1) {
+            ERROR("%s.", strerror(errno));
+            goto exit;
+        }
+    }
+    struct sockaddr_in hstaddr;
+    memset(&hstaddr, 0, sizeof(hstaddr));
+    hstaddr.sin_family = AF_INET;
+    hstaddr.sin_addr.s_addr = c.addr;
+    hstaddr.sin_port = c.port;
+    res = bind(ctx->ss, (struct sockaddr *)&hstaddr, sizeof(hstaddr));
+    if (res == -1) {
+        ERROR("%s.", strerror(errno));
+        goto exit;
+    }
+    res = listen(ctx->ss, c.backlog);
+    if (res == -1) {
+        ERROR("%s.", strerror(errno));
+        goto exit;
+    }
+
+    // io_uring is used if kernel supports it, else epoll
+    if (c.io_uring) {
+        uint entries = 2*(uint)c.max_conns + 8;
+        if (HST_RES_OK == _hst_uring_init(&ctx->ring, entries)) {
+            res = _hst_uring_accept(ctx);
+            if (res != HST_RES_OK) goto exit;
+            ctx->wake_fd = eventfd(0, EFD_CLOEXEC);
+            if (ctx->wake_fd == -1) {
+                ERROR("%s.", strerror(errno));
+                goto exit;
+            }
+            res = _hst_uring_wake(ctx);
+            if (res != HST_RES_OK) goto exit;
+            ctx->state = STATE_CFG;
+            ret = HST_RES_OK;
+            goto exit;
+        }
+    }
+
+    ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epfd == -1) {
+        ERROR("%s.", strerror(errno));
+        goto exit;
+    }
+
+    // listening socket is marked with NULL in epoll event data
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    res = epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->ss, &ev);
+    if (res == -1) {
+        ERROR("%s.", strerror(errno));
+        goto exit;
+    }
+
+    // wake up eventfd is marked with ptr to its descriptor
+    ctx->wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (ctx->wake_fd == -1) {
+        ERROR("%s.", strerror(errno));
+        goto exit;
+    }
+    ev.data.ptr = &ctx->wake_fd;
+    res = epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->wake_fd, &ev);
+    if (res == -1) {
+        ERROR("%s.", strerror(errno));
+        goto exit;
+    }
+
+    ctx->state = STATE_CFG;
+    ret = HST_RES_OK;
+
+exit:
+    if (ret != HST_RES_OK) {
+        hst_deinit(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+
+void hst_deinit(hst_ctx_t *ctx) {
+    if (ctx == NULL)
+        return;
+
+    for (int i = 0; i < ctx->conns_num; i++) {
+        if (ctx->conns[i].sd != -1)
+            close(ctx->conns[i].sd);
+        if (ctx->conns[i].out_fd != -1)
+            close(ctx->conns[i].out_fd);
+        buf_mirror_deinit(&ctx->conns[i].hbuf);
+        mem_deinit(&ctx->conns[i].mem);
+    }
+    free(ctx->conns);
+    for (int i = 0; i < ctx->hbufs_num; i++)
+        buf_mirror_deinit(&ctx->hbufs[i]);
+    free(ctx->hbufs);
+    if (ctx->ss != -1)
+        close(ctx->ss);
+    if (ctx->epfd != -1)
+        close(ctx->epfd);
+    _hst_uring_deinit(&ctx->ring);
+    if (ctx->wake_fd != -1)
+        close(ctx->wake_fd);
+    mem_deinit(&ctx->mem);
+    mem_pool_deinit(&ctx->pool);
+    free(ctx);
+}
+
+
+// Make all workers of hst_run() stop. Instance, which is already running,
+// is woken and hst_read() returns error in it.
+static void _hst_run_stop(hst_run_t *run) {
+    pthread_mutex_lock(&run->lock);
+    __atomic_store_n(&run->stop, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < run->workers_num; i++)
+        if (run->workers[i].ctx)
+            _hst_wake(run->workers[i].ctx);
+    pthread_mutex_unlock(&run->lock);
+}
+
+
+static void *_hst_worker(void *p) {
+    hst_worker_t *w = p;
+
+    if (w->conf.cpu_pin) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (res != 0)
+            ERROR("%s.", strerror(res));
+    }
+
+    hst_ctx_t *ctx = hst_init(&w->conf);
+    if (ctx == NULL) {
+        w->res = HST_RES_ERR;
+        _hst_run_stop(w->run);
+        return NULL;
+    }
+    ctx->stop = &w->run->stop;
+    pthread_mutex_lock(&w->run->lock);
+    w->ctx = ctx;
+    pthread_mutex_unlock(&w->run->lock);
+
+    w->res = HST_RES_OK;
+    w->func(ctx, w->idx, w->arg);
+
+    pthread_mutex_lock(&w->run->lock);
+    w->ctx = NULL;
+    pthread_mutex_unlock(&w->run->lock);
+    hst_deinit(ctx);
+    return NULL;
+}
+
+
+int hst_run(hst_conf_t *conf, hst_worker_func_t func, void *arg) {
+    int i, res, ret;
+
+    hst_conf_t c;
+    if (conf) c = *conf;
+    else memset(&c, 0, sizeof(c));
+    if (c.workers <= 0) c.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (c.workers <= 0) c.workers = 1;
+    c.reuse_port = true;
+
+    // cpus this process is allowed to run on
+    cpu_set_t set;
+    int cpus[CPU_SETSIZE], cpus_num = 0;
+    CPU_ZERO(&set);
+    if (0 == sched_getaffinity(0, sizeof(set), &set)) {
+        for (i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &set))
+                cpus[cpus_num++] = i;
+    }
+    if (cpus_num == 0)
+        c.cpu_pin = false;
+
+    hst_worker_t *w = calloc((size_t)c.workers, sizeof(*w));
+    if (w == NULL) {
+        ERROR("Not enough memory.");
+        return HST_RES_ERR;
+    }
+
+    hst_run_t run;
+    memset(&run, 0, sizeof(run));
+    pthread_mutex_init(&run.lock, NULL);
+    run.workers = w;
+    run.workers_num = c.workers;
+
+    int started = 0;
+    for (i = 0; i < c.workers; i++) {
+        w[i].conf = c;
+        w[i].func = func;
+        w[i].arg = arg;
+        w[i].run = &run;
+        w[i].idx = i;
+        w[i].cpu = cpus_num ? cpus[i % cpus_num] : 0;
+        w[i].res = HST_RES_ERR;
+        res = pthread_create(&w[i].thread, NULL, _hst_worker, &w[i]);
+        if (res != 0) {
+            ERROR("%s.", strerror(res));
+            _hst_run_stop(&run);
+            break;
+        }
+        started++;
+    }
+
+    // workers, which are started, stop on failure of any of them
+    ret = started == c.workers ? HST_RES_OK : HST_RES_ERR;
+    for (i = 0; i < started; i++) {
+        pthread_join(w[i].thread, NULL);
+        if (w[i].res != HST_RES_OK)
+            ret = HST_RES_ERR;
+    }
+
+    pthread_mutex_destroy(&run.lock);
+    free(w);
+    return ret;
+}
+
+
+void hst_udata_set(hst_ctx_t *ctx, void *udata) {
+    ctx->udata = udata;
+}
+
+
+void *hst_udata_get(hst_ctx_t *ctx) {
+    return ctx->udata;
+}
+
+
+int hst_tpl_function(hst_ctx_t *ctx, const char *name, hst_tpl_func_t func) {
+    if (ctx->state != STATE_CFG) {
+        ERROR("Wrong state %d.", ctx->state);
+        return HST_RES_ERR;
+    }
+
+    bool found = false;
+    hst_tpl_fdesc_t *fd = _hst_tpl_function_add(ctx, name, &found);
+    if (fd == NULL) return HST_RES_ERR;
+    if (found && fd->func) {
+        ERROR("Template function is already declared.");
+        return HST_RES_ERR;
+    }
+    fd->func = func;
+    return HST_RES_OK;
+}
+
+
+hst_tpl_t *hst_tpl_compile(hst_ctx_t *ctx, const char *psz) {
+    char name[256];
+    int i;
+
+    if (ctx->state != STATE_CFG) {
+        ERROR("Wrong state %d.", ctx->state);
         goto exit;
     }
 
-    ret = HST_RES_OK;
+    hst_tpl_elt_t *first = NULL;    // first
+    hst_tpl_elt_t *curr = NULL;     // current
+    hst_tpl_elt_t **prev = &first;  // previous
+
+    for (;;) {
+        char *p = strstr(psz, "<!--hst ");
+        if (p == NULL) break;
+
+        // create template element of type "html text"
+        curr = mem_alloc(&ctx->mem, sizeof(*curr));
+        if (curr == NULL) goto exit;
+        curr->next = NULL;
+        curr->text = psz;
+        curr->size = (int)(p - psz);
+        *prev = curr;
+        prev = &curr->next;
+
+        // get template function name
+        for (p+=8; *p==' '; p++)
+            continue;
+        for (i=0; *p && *p!=' ' && *p!='-' && i+1<(int)sizeof(name); )
+            name[i++] = *p++;
+        for (; *p && *p!='>'; p++)
+            continue;
+        if (*p == 0) goto exit;
+        name[i] = 0;
+        psz = p + 1;
+
+        // create template element of type "template function"
+        bool found = false;
+        hst_tpl_fdesc_t *fd = _hst_tpl_function_add(ctx, name, &found);
+        if (fd == NULL) goto exit;
+        if (!found) {  // if added, then must allocate space for name
+            fd->name = _hst_create_strz(&ctx->mem, name, i);
+            if (fd->name == NULL) goto exit;
+        }
+        curr = mem_alloc(&ctx->mem, sizeof(*curr));
+        if (curr == NULL) goto exit;
+        curr->next = NULL;
+        curr->size = 0;
+        curr->fd = fd;
+        *prev = curr;
+        prev = &curr->next;
+    }
+
+    if ( (i=(int)strlen(psz)) ) {
+        curr = mem_alloc(&ctx->mem, sizeof(*curr));
+        if (curr == NULL) goto exit;
+        curr->next = NULL;
+        curr->text = psz;
+        curr->size = i;
+        *prev = curr;
+    }
+
+    return first;
 
 exit:
-    return ret;
+    return NULL;
+}
+
+
+static int _hst_route_cmp(const void *a, const void *b) {
+    const route_node_t *n1 = *(route_node_t * const *)a;
+    const route_node_t *n2 = *(route_node_t * const *)b;
+    return strcmp(n1->name, n2->name);
+}
+
+
+// Compile literal children lists of route tree to sorted arrays.
+static int _hst_route_compile(hst_ctx_t *ctx, route_node_t *n) {
+    route_node_t *c;
+    int i = 0;
+
+    for (c = n->first; c; c = c->next)
+        n->lits_num++;
+    if (n->lits_num) {
+        n->lits = mem_alloc(&ctx->mem, n->lits_num * (int)sizeof(c));
+        if (n->lits == NULL) return HST_RES_ERR;
+    }
+    for (c = n->first; c; c = c->next) {
+        n->lits[i++] = c;
+        if (HST_RES_OK != _hst_route_compile(ctx, c))
+            return HST_RES_ERR;
+    }
+    if (n->lits_num)
+        qsort(n->lits, (size_t)n->lits_num, sizeof(c), _hst_route_cmp);
+
+    if (n->param && HST_RES_OK != _hst_route_compile(ctx, n->param))
+        return HST_RES_ERR;
+    return HST_RES_OK;
+}
+
+
+// Find literal child of route node by name with binary search.
+static route_node_t *_hst_route_lit(const route_node_t *n,
+                                    const hst_view_t *v) {
+    int lo = 0, hi = n->lits_num - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        route_node_t *c = n->lits[mid];
+        int len = c->len < v->len ? c->len : v->len;
+        int res = memcmp(c->name, v->ptr, (size_t)len);
+        if (res == 0) res = c->len - v->len;
+        if (res == 0) return c;
+        if (res < 0) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+
+/* Match path elements starting from 'i' against subtree of route node.
+ * Literal children are preferred to parameter, and parameter to wildcard.
+ *
+ * Input:
+ *      n - route node, which matched previous element
+ *      v - path elements
+ *      i - index of element to match
+ *      num - number of path elements
+ *      m - method index
+ *      params - captured parameters, values of wildcards are set later
+ *      params_num - number of captured parameters
+ * Return:
+ *      route node with handler or NULL
+ */
+static route_node_t *_hst_route_match(route_node_t *n, const hst_view_t *v,
+                                      int i, int num, int m,
+                                      hst_param_t *params, int *params_num) {
+    route_node_t *r;
+
+    if (i == num && n->func[m])
+        return n;
+
+    if (i < num) {
+        r = _hst_route_lit(n, &v[i]);
+        if (r && (r = _hst_route_match(r, v, i+1, num, m, params, params_num)))
+            return r;
+
+        if (n->param) {
+            hst_param_t *p = &params[(*params_num)++];
+            p->name = n->param->name;
+            p->value = v[i];
+            r = _hst_route_match(n->param, v, i+1, num, m, params, params_num);
+            if (r) return r;
+            (*params_num)--;
+        }
+    }
+
+    // wildcard matches rest of path, which may be empty
+    if (n->wild && n->wild->func[m]) {
+        hst_param_t *p = &params[(*params_num)++];
+        p->name = n->wild->name;
+        p->value.ptr = NULL;
+        p->value.len = i;
+        return n->wild;
+    }
+    return NULL;
+}
+
+
+/* Add route. Pattern is path with elements separated by '/'. Element is
+ * matched literally, or ':name' matches any element and captures it as
+ * parameter, or last element '*name' or '*' matches rest of path.
+ * Routes are added before first call to hst_read(), then they are
+ * compiled for matching by hst_route_dispatch().
+ *
+ * Input:
+ *      methods - HST_METHOD_* flags
+ *      pattern - path pattern like '/users/:id', last element may be
+ *                wildcard like '*path'
+ *      func - request handler
+ *      arg - argument for handler
+ */
+int hst_route(hst_ctx_t *ctx, int methods, const char *pattern,
+              hst_route_func_t func, void *arg) {
+    if (ctx->state != STATE_CFG) {
+        ERROR("Wrong state %d.", ctx->state);
+        return HST_RES_ERR;
+    }
+
+    mem_t *mem = &ctx->mem;
+    if (ctx->routes == NULL) {
+        ctx->routes = mem_alloc(mem, sizeof(route_node_t));
+        if (ctx->routes == NULL) return HST_RES_ERR;
+        memset(ctx->routes, 0, sizeof(route_node_t));
+    }
+
+    route_node_t *n = ctx->routes;
+    int params_num = 0;
+    const char *p = pattern;
+    for (;;) {
+        for (; *p == '/'; p++)
+            ;
+        if (!*p) break;
+        int len = (int)strcspn(p, "/");
+        bool param = (*p == ':');
+        bool wild = (*p == '*');
+        if ((wild && p[len]) || (param && len == 1) ||
+                ((param || wild) && ++params_num > ROUTE_PARAMS_MAX)) {
+            ERROR("Wrong route pattern.");
+            return HST_RES_ERR;
+        }
+
+        // find or add child
+        route_node_t **link = param ? &n->param : wild ? &n->wild : &n->first;
+        const char *name = (param || (wild && len > 1)) ? p+1 : p;
+        int name_len = (param || (wild && len > 1)) ? len-1 : len;
+        if (!param && !wild) {
+            for (; *link; link = &(*link)->next)
+                if ((*link)->len == len &&
+                        0 == strncmp((*link)->name, p, (size_t)len))
+                    break;
+        }
+        if (*link && param && ((*link)->len != name_len ||
+                strncmp((*link)->name, name, (size_t)name_len))) {
+            ERROR("Parameter name differs from other route.");
+            return HST_RES_ERR;
+        }
+        if (*link == NULL) {
+            route_node_t *c = mem_alloc(mem, sizeof(*c));
+            if (c == NULL) return HST_RES_ERR;
+            memset(c, 0, sizeof(*c));
+            c->name = _hst_create_strz(mem, name, name_len);
+            if (c->name == NULL) return HST_RES_ERR;
+            c->len = name_len;
+            *link = c;
+        }
+        n = *link;
+        p += len;
+    }
+
+    // set handler for methods
+    for (int m = 0; m < ROUTE_METHODS; m++) {
+        if (!(methods & (1 << m)))
+            continue;
+        if (n->func[m]) {
+            ERROR("Route is already added.");
+            return HST_RES_ERR;
+        }
+        n->func[m] = func;
+        n->arg[m] = arg;
+    }
+    return HST_RES_OK;
 }
 
 
-// Write data to client socket.
-static int _hst_write(const void *ptr, int size) {
+int hst_read(hst_ctx_t *ctx, hst_req_t **req) {
     int ret = HST_RES_ERR;
 
-    while (size) {
-        ret = _hst_is_socket_ready(false);
-        if (ret != HST_RES_OK) goto exit;
+    if (ctx->state == STATE_CFG) {
+        if (ctx->routes && HST_RES_OK != _hst_route_compile(ctx, ctx->routes))
+            goto exit;
+        ctx->checkpoint = mem_checkpoint_get(&ctx->mem);
+        ctx->state = STATE_READ;
+    } else if (ctx->state != STATE_READ) {
+        ERROR("Wrong state %d.", ctx->state);
+        goto exit;
+    }
 
-        ret = (int)send(me.sc, ptr, (size_t)size, 0);
-        if (ret < 0) {
-            ERROR("%s.", strerror(errno));
+    for (;;) {
+        // other worker of hst_run() failed
+        if (ctx->stop && __atomic_load_n(ctx->stop, __ATOMIC_SEQ_CST))
+            goto exit;
+
+        // hand next ready request to application
+        conn_t *c = ctx->ready_first;
+        if (c) {
+            ctx->ready_first = c->next;
+            if (ctx->ready_first == NULL)
+                ctx->ready_last = NULL;
+            c->next = NULL;
+            c->state = CONN_HANDLE;
+            ctx->conn = c;
+            ctx->req = c->req;
+            ctx->state = STATE_WR_RES;
+            *req = c->req;
+            ret = HST_RES_OK;
+            goto exit;
+        }
+
+        // wait for events or timeout
+        int n;
+        if (ctx->ring.fd != -1)
+            n = _hst_uring_poll(ctx);
+        else
+            n = _hst_epoll_poll(ctx);
+        if (n < 0) {
+            ret = n;
+            goto exit;
+        }
+        _hst_conn_expire(ctx);
+
+        bool woken = ctx->woken;
+        ctx->woken = false;
+        if ((n == 0 || woken) && ctx->ready_first == NULL) {
+            ret = HST_RES_CONT;
             goto exit;
         }
-        size -= ret;
     }
-    ret = HST_RES_OK;
 
 exit:
     return ret;
 }
 
 
-// Write chunk to client socket.
-static int _hst_write_chunk(const void *ptr, int size) {
-    char buf[32];
-    int res = snprintf(buf, sizeof(buf), "%d\r\n", size);
-    if (res < 0) {
-        ERROR("%s.", strerror(errno));
+// Handle of deferred request combines connection index and generation, so
+// handle of request, which connection is already closed, is recognised.
+static hst_defer_t *_hst_defer_handle(hst_ctx_t *ctx, conn_t *c) {
+    uintptr_t n = (uintptr_t)ctx->conns_num;
+    return (hst_defer_t *)((uintptr_t)c->gen*n + (uintptr_t)(c - ctx->conns) + 1);
+}
+
+
+/* Detach current request, so other requests can be read and handled while
+ * reply to it is prepared. Connection of request is not read from until
+ * reply is finished. Connection is closed if client hangs up or reply is
+ * not resumed within defer timeout, but request object stays valid until
+ * hst_req_resume() is called, which must be done for every handle.
+ *
+ * Return:
+ *      handle to be passed to hst_req_resume() or NULL on error
+ */
+hst_defer_t *hst_req_defer(hst_ctx_t *ctx) {
+    hst_defer_t *ret = NULL;
+
+    if (ctx->state != STATE_WR_RES) {
+        ERROR("Wrong state %d.", ctx->state);
+        return NULL;
+    }
+
+    conn_t *c = ctx->conn;
+    c->state = CONN_DEFERRED;
+    _hst_timer_set(ctx, c, ctx->defer_timeout);
+    if (HST_RES_OK == _hst_conn_watch(ctx, c))
+        ret = _hst_defer_handle(ctx, c);
+    else
+        _hst_conn_close(ctx, c);
+
+    ctx->conn = NULL;
+    ctx->req = NULL;
+    ctx->state = STATE_READ;
+    return ret;
+}
+
+
+/* Make deferred request current again, so reply to it can be written with
+ * hst_write_*() functions. No other request may be current at that time.
+ * Other threads may call hst_wake() to make hst_read() return, when reply
+ * can be resumed.
+ *
+ * Input:
+ *      d - handle returned by hst_req_defer()
+ *      req - receives ptr to request object, may be NULL
+ * Return:
+ *      HST_RES_OK - request is current
+ *      HST_RES_CONT - connection is already closed, as client hung up or
+ *          defer timeout expired; request object is released now
+ *      HST_RES_ERR - error
+ */
+int hst_req_resume(hst_ctx_t *ctx, hst_defer_t *d, hst_req_t **req) {
+    if (ctx->state != STATE_READ) {
+        ERROR("Wrong state %d.", ctx->state);
         return HST_RES_ERR;
     }
-    res = _hst_write(buf, res);
-    if (res != HST_RES_OK) return HST_RES_ERR;
-    res = _hst_write(ptr, size);
-    if (res != HST_RES_OK) return HST_RES_ERR;
+    if (d == NULL) {
+        ERROR("Bad handle.");
+        return HST_RES_ERR;
+    }
+
+    uintptr_t idx = ((uintptr_t)d - 1) % (uintptr_t)ctx->conns_num;
+    conn_t *c = &ctx->conns[idx];
+    if (_hst_defer_handle(ctx, c) != d ||
+            (c->state != CONN_DEFERRED && c->state != CONN_CLOSED)) {
+        ERROR("Bad handle.");
+        return HST_RES_ERR;
+    }
+    if (c->state == CONN_CLOSED) {
+        _hst_conn_close(ctx, c);
+        return HST_RES_CONT;
+    }
+
+    // stop watching for hang up, reply is written now
+    _hst_timer_del(c);
+    c->state = CONN_HANDLE;
+    if (HST_RES_OK != _hst_conn_watch(ctx, c)) {
+        _hst_conn_close(ctx, c);
+        return HST_RES_CONT;
+    }
+
+    ctx->conn = c;
+    ctx->req = c->req;
+    ctx->state = STATE_WR_RES;
+    if (req) *req = c->req;
     return HST_RES_OK;
 }
 
 
-static int _hst_write_body_init(void) {
-    if (me.state == STATE_WR_HDR) {
-        // allocate buffer for reply body
-        int res = buf_alloc(&me.bbuf, CHUNK_SIZE);
-        if (res != HST_RES_OK) goto exit;
-        me.state = STATE_WR_BODY;
+/* Wake instance, so hst_read() returns HST_RES_CONT. It may be called from
+ * any thread, e.g. when data for deferred reply is ready.
+ */
+void hst_wake(hst_ctx_t *ctx) {
+    _hst_wake(ctx);
+}
+
+
+/* Wait for more body data of current request in event loop. Application
+ * gets request from hst_read() again, when data arrives or body can not be
+ * read any more.
+ *
+ * Return:
+ *      HST_RES_CONT - request is not current any more
+ *      other - error
+ */
+static int _hst_body_wait(hst_ctx_t *ctx) {
+    conn_t *c = ctx->conn;
+
+    if (ctx->state != STATE_WR_RES) {
+        ERROR("Reply is already started.");
+        return HST_RES_ERR;
+    }
+
+    // whole body is read in limited time
+    if (c->body_deadline <= ctx->now) {
+        ERROR("Timed out.");
+        return HST_RES_TIMEOUT;
+    }
+    c->state = CONN_RD_STREAM;
+    _hst_timer_set(ctx, c, (int)(c->body_deadline - ctx->now));
+    if (HST_RES_OK != _hst_conn_watch(ctx, c)) {
+        _hst_timer_del(c);
+        c->state = CONN_HANDLE;
+        return HST_RES_ERR;
+    }
+
+    ctx->conn = NULL;
+    ctx->req = NULL;
+    ctx->state = STATE_READ;
+    return HST_RES_CONT;
+}
+
+
+/* Read piece of body of current request. It is used instead of
+ * 'body' field of request if 'body_stream' option is set, so body of any
+ * size is read with constant memory. Data already read with headers is
+ * given first, then it is read from socket. Worker is never blocked: if
+ * there is no data, request is left until data arrives and then it is
+ * handed to application by hst_read() again, with the same 'udata'. Whole
+ * body must arrive within body timeout after headers. Body, which is not
+ * read completely, makes connection to be closed after reply. Body is to
+ * be read before reply is written.
+ *
+ * Input:
+ *      ptr - buffer for body data
+ *      max - size of buffer
+ * Return:
+ *      number of bytes put to buffer, 0 at end of body,
+ *      HST_RES_CONT - no data now, application must return without reply,
+ *      HST_RES_ERR - error, e.g. body timeout, reply closes connection
+ */
+int hst_read_body(hst_ctx_t *ctx, void *ptr, int max) {
+    conn_t *c = ctx->conn;
+    if (c == NULL || !c->body_stream || max <= 0) {
+        ERROR("Wrong state %d.", ctx->state);
+        return HST_RES_ERR;
+    }
+    if (c->body_err)
+        return HST_RES_ERR;
+
+    buf_t *buf = &c->hbuf;
+    int res, n;
+
+    for (;;) {
+        // use data already read
+        n = buf->len - buf->sta;
+        if (c->body_chunked) {
+            int used;
+            if (c->chunk_state == CH_DONE)
+                return 0;
+            res = _hst_chunked_parse(c, buf->buf+buf->sta, n, &used,
+                                     ptr, max, &n);
+            buf->sta += used;
+            if (res == HST_RES_BADREQUEST) goto error;
+            if (n > 0) return n;
+            if (res == HST_RES_OK) return 0;
+        } else {
+            if (c->body_len == 0)
+                return 0;
+            if (n > c->body_len) n = c->body_len;
+            if (n > max) n = max;
+            if (n > 0) {
+                memcpy(ptr, buf->buf+buf->sta, (size_t)n);
+                buf->sta += n;
+                c->body_len -= n;
+                return n;
+            }
+        }
+
+        // all data is used, so body data is read to buffer of application
+        // directly, other data is read to headers buffer after headers
+        buf->sta = buf->len = c->hdr_end;
+        if (!c->body_chunked || c->chunk_state == CH_DATA) {
+            int *left = c->body_chunked ? &c->chunk_left : &c->body_len;
+            res = _hst_recv(c, ptr, *left < max ? *left : max);
+            if (res == HST_RES_CONT) goto wait;
+            if (res < 0) goto error;
+            *left -= res;
+            if (c->body_chunked && *left == 0)
+                c->chunk_state = CH_DATA_CR;
+            return res;
+        }
+        if (buf->len == c->hdr_sta + buf->tot) {
+            ERROR("No space in buffer.");
+            goto error;
+        }
+        res = _hst_recv(c, buf->buf+buf->len,
+                        c->hdr_sta + buf->tot - buf->len);
+        if (res == HST_RES_CONT) goto wait;
+        if (res < 0) goto error;
+        buf->len += res;
+    }
+
+wait:
+    if (HST_RES_CONT == _hst_body_wait(ctx))
+        return HST_RES_CONT;
+
+error:
+    c->body_err = true;
+    return HST_RES_ERR;
+}
+
+
+/* Multipart parser states.
+ *
+ * MP_PREAMBLE
+ *      Searching for first delimiter.
+ * MP_DELIM_END
+ *      Delimiter is found, waiting for end of its line or '--' after
+ *      last one.
+ * MP_HEADERS
+ *      Reading part header lines.
+ * MP_DATA
+ *      Passing part content to application up to next delimiter.
+ * MP_DONE
+ *      Last delimiter is found.
+ */
+typedef enum _mpart_state {
+    MP_PREAMBLE,
+    MP_DELIM_END,
+    MP_HEADERS,
+    MP_DATA,
+    MP_DONE
+} mpart_state_t;
+
+
+// Multipart/form-data parser.
+typedef struct _mpart_t {
+    hst_ctx_t *ctx;
+    hst_part_func_t func;       // application function
+    void *arg;                  // application function argument
+    hst_part_t part;            // current part
+    mpart_state_t state;
+    int checkpoint;             // memory checkpoint for part strings
+    int base;                   // memory checkpoint before parser
+    int len;                    // length of data in buffer
+    char *buf;                  // buffer for streamed body
+    bool start;                 // nothing is parsed yet
+    char delim[4+70];           // CRLF, '--' and boundary
+    char padding[5];
+    bmh_t bmh;                  // delimiter search
+} mpart_t;
+
+
+// Get parameter of header value, like 'name' in 'form-data; name="x"'.
+// Quoted string is unescaped. Returns zero-terminated value or NULL.
+static char *_hst_mpart_param(mem_t *mem, const char *p, const char *end,
+                              const char *name) {
+    int len = (int)strlen(name);
+    for (;;) {
+        // skip to next parameter, quoted strings may contain ';'
+        for (; p < end && *p != ';'; p++) {
+            if (*p != '"') continue;
+            for (p++; p < end && *p != '"'; p++)
+                if (*p == '\\') p++;
+        }
+        if (p >= end) return NULL;
+        for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+            ;
+        tok_t tok = {p, len, {0}};
+        if (end - p <= len || p[len] != '=' || 0 != tok_cmpi_strz(&tok, name))
+            continue;
+
+        // value is token or quoted string
+        p += len + 1;
+        bool quoted = (p < end && *p == '"');
+        const char *v = quoted ? ++p : p;
+        if (quoted) {
+            for (; p < end && *p != '"'; p++)
+                if (*p == '\\') p++;
+        } else {
+            for (; p < end && *p != ';' && *p != ' ' && *p != '\t'; p++)
+                ;
+        }
+        if (p > end) p = end;
+        char *s = _hst_create_strz(mem, v, (int)(p - v));
+        if (s == NULL || !quoted)
+            return s;
+        char *d = s;
+        for (char *q = s; *q; q++) {
+            if (*q == '\\' && q[1]) q++;
+            *d++ = *q;
+        }
+        *d = 0;
+        return s;
+    }
+}
+
+
+// Parse part header line [p, end) without CRLF.
+static int _hst_mpart_header(mpart_t *m, const char *p, const char *end) {
+    mem_t *mem = &m->ctx->conn->mem;
+    tok_t name;
+    name.ptr = p;
+    const char *t = memchr(p, ':', (size_t)(end - p));
+    if (t == NULL || t == p) return HST_RES_BADREQUEST;
+    name.len = (int)(t - p);
+    for (t++; t < end && (*t == ' ' || *t == '\t'); t++)
+        ;
+
+    if (0 == tok_cmpi_strz(&name, "Content-Disposition")) {
+        m->part.name = _hst_mpart_param(mem, t, end, "name");
+        m->part.filename = _hst_mpart_param(mem, t, end, "filename");
+    } else if (0 == tok_cmpi_strz(&name, "Content-Type")) {
+        m->part.content_type = _hst_create_strz(mem, t, (int)(end - t));
+        if (m->part.content_type == NULL) return HST_RES_INTERNAL;
+    }
+    return HST_RES_OK;
+}
+
+
+/* Parse multipart data. Parser keeps its state, so data may be passed in
+ * pieces. Part content is passed to application in pieces as soon as it
+ * can not be a part of delimiter.
+ *
+ * Input:
+ *      m - parser
+ *      p - data
+ *      len - length of data
+ *      final - no more data follows
+ *      used - receives number of bytes consumed, the rest is to be passed
+ *             again with more data
+ * Return:
+ *      HST_RES_OK - last delimiter is found
+ *      HST_RES_CONT - more data needed
+ *      other - error or result of application function
+ */
+static int _hst_mpart_parse(mpart_t *m, const char *p, int len, bool final,
+                            int *used) {
+    int res = HST_RES_CONT;
+    const char *s = p, *end = p + len, *t;
+    int dlen = m->bmh.len;
+
+    while (m->state != MP_DONE) {
+        if (m->state == MP_PREAMBLE) {
+            // first delimiter may be at body start without CRLF
+            if (m->start) {
+                if (end - s < dlen-2 && !final) break;
+                m->start = false;
+                if (end - s >= dlen-2 && 0 == memcmp(s, m->delim+2,
+                                                     (size_t)(dlen-2))) {
+                    s += dlen-2;
+                    m->state = MP_DELIM_END;
+                    continue;
+                }
+            }
+            t = bmh_find(&m->bmh, s, end);
+            if (t == end) {
+                if (end - s > dlen-1) s = end - (dlen-1);
+                break;
+            }
+            s = t + dlen;
+            m->state = MP_DELIM_END;
+
+        } else if (m->state == MP_DELIM_END) {
+            if (end - s < 2) break;
+            if (s[0] == '-' && s[1] == '-') {
+                s += 2;
+                m->state = MP_DONE;
+                continue;
+            }
+            // transport padding is allowed before CRLF
+            t = memchr(s, '\n', (size_t)(end - s));
+            if (t == NULL) break;
+            for (; *s == ' ' || *s == '\t'; s++)
+                ;
+            if (s+1 != t || *s != '\r') goto ebadrequest;
+            s = t + 1;
+            mem_checkpoint_restore(&m->ctx->conn->mem, m->checkpoint);
+            m->part.name = NULL;
+            m->part.filename = NULL;
+            m->part.content_type = NULL;
+            m->part.idx++;
+            m->state = MP_HEADERS;
+
+        } else if (m->state == MP_HEADERS) {
+            t = memchr(s, '\n', (size_t)(end - s));
+            if (t == NULL) break;
+            if (t == s || t[-1] != '\r') goto ebadrequest;
+            if (t - s == 1) {
+                m->state = MP_DATA;
+            } else {
+                res = _hst_mpart_header(m, s, t-1);
+                if (res != HST_RES_OK) goto exit;
+                res = HST_RES_CONT;
+            }
+            s = t + 1;
+
+        } else {  // MP_DATA
+            t = bmh_find(&m->bmh, s, end);
+            if (t == end) {
+                // tail may be start of delimiter, it is kept
+                t = end - (dlen-1);
+                if (t > s) {
+                    res = m->func(m->ctx, &m->part, s, (int)(t - s), false,
+                                  m->arg);
+                    if (res != HST_RES_OK) goto exit;
+                    res = HST_RES_CONT;
+                    s = t;
+                }
+                break;
+            }
+            res = m->func(m->ctx, &m->part, s, (int)(t - s), true, m->arg);
+            if (res != HST_RES_OK) goto exit;
+            res = HST_RES_CONT;
+            s = t + dlen;
+            m->state = MP_DELIM_END;
+        }
+    }
+
+    if (m->state == MP_DONE)
+        res = HST_RES_OK;
+    else if (final)
+        goto ebadrequest;
+
+exit:
+    *used = (int)(s - p);
+    return res;
+
+ebadrequest:
+    ERROR("Malformed multipart body.");
+    res = HST_RES_BADREQUEST;
+    goto exit;
+}
+
+
+// Create multipart parser for body of current request.
+static mpart_t *_hst_mpart_new(hst_ctx_t *ctx) {
+    conn_t *c = ctx->conn;
+
+    // get boundary from 'Content-Type' header
+    const hst_view_t *v = &c->req->hdr_known[HST_HDR_CONTENT_TYPE];
+    const char *ct = "multipart/form-data";
+    tok_t tok = {v->ptr, (int)strlen(ct), {0}};
+    if (v->ptr == NULL || v->len < tok.len || 0 != tok_cmpi_strz(&tok, ct)) {
+        ERROR("Not multipart body.");
+        return NULL;
+    }
+    int base = mem_checkpoint_get(&c->mem);
+    char *boundary = _hst_mpart_param(&c->mem, v->ptr + tok.len,
+                                      v->ptr + v->len, "boundary");
+    int blen = boundary ? (int)strlen(boundary) : 0;
+    if (blen < 1 || blen > 70) {
+        ERROR("Wrong boundary.");
+        goto error;
     }
 
-    if (me.state == STATE_WR_BODY ||
-            me.state == STATE_WR_BODY_CHUNKED)
-        return HST_RES_OK;
+    mpart_t *m = mem_alloc(&c->mem, sizeof(*m));
+    if (m == NULL) goto error;
+    memset(m, 0, sizeof(*m));
+    m->ctx = ctx;
+    m->part.idx = -1;
+    m->state = MP_PREAMBLE;
+    m->start = true;
+    m->base = base;
+    memcpy(m->delim, "\r\n--", 4);
+    memcpy(m->delim+4, boundary, (size_t)blen);
+    bmh_init(&m->bmh, m->delim, 4 + blen);
+
+    // unused data of streamed body is moved to buffer start before next read
+    if (c->body_stream) {
+        m->buf = mem_alloc(&c->mem, MPART_SIZE);
+        if (m->buf == NULL) goto error;
+    }
+    m->checkpoint = mem_checkpoint_get(&c->mem);
+    return m;
 
-exit:
-    return HST_RES_ERR;
+error:
+    mem_checkpoint_restore(&c->mem, base);
+    return NULL;
 }
 
 
-static int _hst_write_body_begin_chunked(void) {
-    int ret;
+/* Parse multipart/form-data body of current request and pass content of
+ * each part to application function in pieces. Body is taken from request
+ * or read with hst_read_body() if 'body_stream' option is used, then body
+ * is not buffered and may be of any size. It must be called before reply
+ * body is written. Strings of part object are valid until next part.
+ * If streamed body data is waited for, parser state is kept and parsing
+ * goes on when function is called for request handed again by hst_read().
+ *
+ * Input:
+ *      func - function to receive parts content, it should return
+ *             HST_RES_OK to continue
+ *      arg - argument for function
+ * Return:
+ *      HST_RES_OK - all parts are passed
+ *      HST_RES_CONT - no body data now, as with hst_read_body()
+ *      HST_RES_ERR - body is not multipart or malformed
+ *      other - result of application function, which stopped parsing
+ */
+int hst_read_multipart(hst_ctx_t *ctx, hst_part_func_t func, void *arg) {
+    conn_t *c = ctx->conn;
+    if (c == NULL) {
+        ERROR("Wrong state %d.", ctx->state);
+        return HST_RES_ERR;
+    }
 
-    // add transfer-encoding header and end-of-headers sign
-    ret = buf_printf(&me.hbuf, "Transfer-Encoding: chunked\r\n\r\n");
-    if (ret != HST_RES_OK) goto exit;
+    mpart_t *m = c->mpart;
+    if (m == NULL) {
+        m = _hst_mpart_new(ctx);
+        if (m == NULL) return HST_RES_ERR;
+        c->mpart = m;
+    }
+    m->func = func;
+    m->arg = arg;
 
-    // send headers
-    ret = _hst_write(me.hbuf.buf, me.hbuf.len);
-    if (ret != HST_RES_OK) goto exit;
+    int res, used, n;
+    if (!c->body_stream) {
+        res = _hst_mpart_parse(m, c->req->body, c->req->body_len, true, &used);
+    } else {
+        res = (m->state == MP_DONE) ? HST_RES_OK : HST_RES_CONT;
+        while (res == HST_RES_CONT) {
+            n = hst_read_body(ctx, m->buf+m->len, MPART_SIZE-m->len);
+            if (n == HST_RES_CONT) return HST_RES_CONT;
+            if (n < 0) goto exit;
+            m->len += n;
+            res = _hst_mpart_parse(m, m->buf, m->len, n == 0, &used);
+            m->len -= used;
+            memmove(m->buf, m->buf+used, (size_t)m->len);
+            if (res == HST_RES_CONT && m->len == MPART_SIZE) {
+                ERROR("Part headers do not fit in buffer.");
+                res = HST_RES_ERR;
+            }
+        }
 
-    // write out body as chunks
-    for (; me.bbuf.len-me.bbuf.sta > CHUNK_SIZE; me.bbuf.sta+=CHUNK_SIZE) {
-        ret = _hst_write_chunk(me.bbuf.buf+me.bbuf.sta, CHUNK_SIZE);
-        if (ret != HST_RES_OK) goto exit;
+        // skip epilogue
+        while (res == HST_RES_OK &&
+               (n = hst_read_body(ctx, m->buf, MPART_SIZE)) > 0)
+            ;
+        if (res == HST_RES_OK && n == HST_RES_CONT)
+            return HST_RES_CONT;
     }
-    buf_shift(&me.bbuf);
-    me.state = STATE_WR_BODY_CHUNKED;
+    if (res == HST_RES_BADREQUEST || res == HST_RES_INTERNAL)
+        res = HST_RES_ERR;
 
 exit:
-    return ret;
+    c->mpart = NULL;
+    mem_checkpoint_restore(&c->mem, m->base);
+    return (res == HST_RES_CONT) ? HST_RES_ERR : res;
 }
 
 
-/* Set internal state to STATE_WR_ERROR and send 500 reply.
- * In case of errors, do as much as possible without error reporting.
+/* Match request path against routes in one walk of route tree and call
+ * handler of matched route. Captured parameters are set to request.
+ *
+ * Return:
+ *      HST_RES_OK - handler is called
+ *      HST_RES_CONT - there is no matching route
+ *      HST_RES_ERR - error
  */
-static void _hst_write_error(void) {
-    if (me.state == STATE_WR_ERROR)
-        return;
+int hst_route_dispatch(hst_ctx_t *ctx, hst_req_t *req) {
+    int m = req->method_get ? ROUTE_GET :
+            req->method_post ? ROUTE_POST : ROUTE_HEAD;
+    if (ctx->routes == NULL)
+        return HST_RES_CONT;
+
+    // path elements as views, array is built for list of elements
+    const hst_view_t *v = req->path_views;
+    int num = req->path_views_num;
+    if (!ctx->req_views) {
+        hst_path_elt_t *e;
+        for (num = 0, e = req->path_elt_first; e; e = e->next)
+            num++;
+        hst_view_t *a = mem_alloc(req->mem, num * (int)sizeof(*a));
+        if (a == NULL && num) return HST_RES_ERR;
+        for (num = 0, e = req->path_elt_first; e; e = e->next, num++) {
+            a[num].ptr = e->name;
+            a[num].len = (int)strlen(e->name);
+        }
+        v = a;
+    }
 
-    if (me.sc != -1 && me.state != STATE_WR_BODY_CHUNKED) {
-        int res = _hst_is_socket_ready(false);
-        if (res == HST_RES_OK) {
-            const char *p = "HTTP/1.1 500 Internal server error\r\n\r\n";
-            send(me.sc, p, 38, 0);
+    hst_param_t params[ROUTE_PARAMS_MAX];
+    int params_num = 0;
+    route_node_t *r = _hst_route_match(ctx->routes, v, 0, num, m,
+                                       params, &params_num);
+    if (r == NULL)
+        return HST_RES_CONT;
+
+    // value of wildcard is rest of path in request-target
+    hst_param_t *last = params_num ? &params[params_num-1] : NULL;
+    if (last && last->value.ptr == NULL) {
+        const char *p = req->request_target;
+        const char *end = p + strcspn(p, "?");
+        for (int i = last->value.len; ; i--) {
+            for (; p < end && *p == '/'; p++)
+                ;
+            if (i == 0) break;
+            for (; p < end && *p != '/'; p++)
+                ;
         }
+        last->value.ptr = p;
+        last->value.len = (int)(end - p);
     }
 
-    shutdown(me.sc, SHUT_RDWR);
-    close(me.sc);
-    me.sc = -1;
-    me.state = STATE_WR_ERROR;
-}
+    if (params_num) {
+        req->params = mem_alloc(req->mem, params_num * (int)sizeof(*params));
+        if (req->params == NULL) return HST_RES_ERR;
+        memcpy(req->params, params, (size_t)params_num * sizeof(*params));
+        req->params_num = params_num;
+    }
 
+    r->func[m](ctx, req, r->arg[m]);
+    return HST_RES_OK;
+}
 
-int hst_init(hst_conf_t *conf) {
-    int res, ret = HST_RES_ERR;
 
-    if (me.state != STATE_NOT_INIT) {
-        ERROR("Already initialized.");
-        goto exit;
-    }
+// Get value of path parameter captured by route or NULL.
+const hst_view_t *hst_req_param(const hst_req_t *req, const char *name) {
+    for (int i = 0; i < req->params_num; i++)
+        if (0 == strcmp(req->params[i].name, name))
+            return &req->params[i].value;
+    return NULL;
+}
 
-    // set module configuration
-    hst_conf_t c;
-    if (conf) c = *conf;
-    else memset(&c, 0, sizeof(c));
-    if (!c.backlog) c.backlog = DFLT_CONF_BACKLOG;
-    if (!c.port) c.port = DFLT_CONF_PORT;
-    if (c.mem_total < DFLT_CONF_MEM_TOTAL) c.mem_total = DFLT_CONF_MEM_TOTAL;
 
-    // init memory allocator
-    res = mem_init(c.mem_total);
-    if (res != HST_RES_OK) goto exit;
+// Number of header views of request. Views are set if 'req_views' option
+// is used, they point to request data and are not zero-terminated.
+int hst_req_hdr_count(const hst_req_t *req) {
+    return req->hdr_views_num;
+}
 
-    // allocate headers buffer
-    res = buf_alloc(&me.hbuf, HBUF_SIZE);
-    if (res != HST_RES_OK) goto exit;
 
-    // allocate request object
-    me.req = mem_alloc(sizeof(*me.req));
-    if (me.req == NULL) goto exit;
+// Header view by index or NULL if index is out of range.
+const hst_hdr_view_t *hst_req_hdr_at(const hst_req_t *req, int i) {
+    if (i < 0 || i >= req->hdr_views_num)
+        return NULL;
+    return &req->hdr_views[i];
+}
 
-    me.ss = -1;
-    me.sc = -1;
 
-    me.ss = socket(AF_INET, SOCK_STREAM, 0);
-    if (me.ss == -1) {
-        ERROR("%s.", strerror(errno));
-        goto exit;
-    }
-    int yes = 1;
-    res = setsockopt(me.ss, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes));
-    if (res == -1) {
-        ERROR("%s.", strerror(errno));
-        goto exit;
-    }
-    res = ioctl(me.ss, FIONBIO, (char *)&yes);
-    if (res == -1) {
-        ERROR("%s.", strerror(errno));
-        goto exit;
-    }
-    struct sockaddr_in hstaddr;
-    memset(&hstaddr, 0, sizeof(hstaddr));
-    hstaddr.sin_family = AF_INET;
-    hstaddr.sin_addr.s_addr = c.addr;
-    hstaddr.sin_port = c.port;
-    res = bind(me.ss, (struct sockaddr *)&hstaddr, sizeof(hstaddr));
-    if (res == -1) {
-        ERROR("%s.", strerror(errno));
-        goto exit;
-    }
-    res = listen(me.ss, c.backlog);
-    if (res == -1) {
-        ERROR("%s.", strerror(errno));
-        goto exit;
-    }
+// Number of path element views of request.
+int hst_req_path_count(const hst_req_t *req) {
+    return req->path_views_num;
+}
 
-    me.state = STATE_CFG;
-    ret = HST_RES_OK;
 
-exit:
-    return ret;
+// Path element view by index or NULL if index is out of range.
+const hst_view_t *hst_req_path_at(const hst_req_t *req, int i) {
+    if (i < 0 || i >= req->path_views_num)
+        return NULL;
+    return &req->path_views[i];
 }
 
 
-void hst_deinit(void) {
-    if (me.state == STATE_NOT_INIT)
-        return;
-
-    if (me.sc != -1)
-        close(me.sc);
-    if (me.ss != -1)
-        close(me.ss);
-    mem_deinit();
-    memset(&me, 0, sizeof(me));  // implicitly set me.state to STATE_NOT_INIT
+// Value of well-known header or NULL if request has no such header.
+const hst_view_t *hst_req_hdr_get(const hst_req_t *req, hst_hdr_id_t id) {
+    if (id <= HST_HDR_OTHER || id >= HST_HDR_NUM ||
+            req->hdr_known[id].ptr == NULL)
+        return NULL;
+    return &req->hdr_known[id];
 }
 
 
-int hst_tpl_function(const char *name, hst_tpl_func_t func) {
-    if (me.state != STATE_CFG) {
-        ERROR("Wrong state %d.", me.state);
-        return HST_RES_ERR;
-    }
-
-    bool found = false;
-    hst_tpl_fdesc_t *fd = _hst_tpl_function_add(name, &found);
-    if (fd == NULL) return HST_RES_ERR;
-    if (found && fd->func) {
-        ERROR("Template function is already declared.");
-        return HST_RES_ERR;
+// Decode percent-encoded zero-terminated string in place, '+' means space.
+// Malformed escapes are kept as is.
+static void _hst_url_decode(char *s) {
+    char *d = s;
+    for (; *s; s++, d++) {
+        if (*s == '+') {
+            *d = ' ';
+        } else if (*s == '%' && _hst_hex_digit(s[1]) >= 0 &&
+                   _hst_hex_digit(s[2]) >= 0) {
+            *d = (char)(_hst_hex_digit(s[1]) << 4 | _hst_hex_digit(s[2]));
+            s += 2;
+        } else {
+            *d = *s;
+        }
     }
-    fd->func = func;
-    return HST_RES_OK;
+    *d = 0;
 }
 
 
-hst_tpl_t *hst_tpl_compile(const char *psz) {
-    char name[256];
-    int i;
-
-    if (me.state != STATE_CFG) {
-        ERROR("Wrong state %d.", me.state);
-        goto exit;
+/* Parse name-value pairs of urlencoded string in place and add them to
+ * list. Names and values are percent-decoded.
+ */
+static void _hst_query_parse(mem_t *m, char *p, hst_query_elt_t **last) {
+    while (*p) {
+        char *name = p;
+        p += strcspn(p, "&");
+        if (*p) *p++ = 0;
+        if (!*name) continue;
+
+        char *value = name + strcspn(name, "=");
+        if (*value) *value++ = 0;
+        _hst_url_decode(name);
+        _hst_url_decode(value);
+
+        hst_query_elt_t *e = mem_alloc(m, sizeof(*e));
+        if (e == NULL) break;
+        e->next = NULL;
+        e->name = name;
+        e->value = value;
+        *last = e;
+        last = &e->next;
     }
+}
 
-    hst_tpl_elt_t *first = NULL;    // first
-    hst_tpl_elt_t *curr = NULL;     // current
-    hst_tpl_elt_t **prev = &first;  // previous
 
-    for (;;) {
-        char *p = strstr(psz, "<!--hst ");
-        if (p == NULL) break;
+// Compare query elements by name. Elements with equal names keep their
+// order, as names are in one decoded string.
+static int _hst_query_cmp(const void *a, const void *b) {
+    const hst_query_elt_t *e1 = *(hst_query_elt_t * const *)a;
+    const hst_query_elt_t *e2 = *(hst_query_elt_t * const *)b;
+    int res = strcmp(e1->name, e2->name);
+    if (res == 0) res = (e1->name > e2->name) - (e1->name < e2->name);
+    return res;
+}
 
-        // create template element of type "html text"
-        curr = mem_alloc(sizeof(*curr));
-        if (curr == NULL) goto exit;
-        curr->next = NULL;
-        curr->text = psz;
-        curr->size = (int)(p - psz);
-        *prev = curr;
-        prev = &curr->next;
 
-        // get template function name
-        for (p+=8; *p==' '; p++)
-            continue;
-        for (i=0; *p && *p!=' ' && *p!='-' && i+1<(int)sizeof(name); )
-            name[i++] = *p++;
-        for (; *p && *p!='>'; p++)
-            continue;
-        if (*p == 0) goto exit;
-        name[i] = 0;
-        psz = p + 1;
+/* Build array of query elements sorted by name for binary search.
+ *
+ * Return:
+ *      number of elements in array, 'index' is not set if there are no
+ *      elements or no memory
+ */
+static int _hst_query_index(mem_t *m, hst_query_elt_t *first,
+                            hst_query_elt_t ***index) {
+    int num = 0;
+    hst_query_elt_t *e;
+    for (e = first; e; e = e->next)
+        num++;
+    if (num == 0)
+        return 0;
+
+    hst_query_elt_t **a = mem_alloc(m, num * (int)sizeof(*a));
+    if (a == NULL) return 0;
+    int i = 0;
+    for (e = first; e; e = e->next)
+        a[i++] = e;
+    qsort(a, (size_t)num, sizeof(*a), _hst_query_cmp);
+    *index = a;
+    return num;
+}
 
-        // create template element of type "template function"
-        bool found = false;
-        hst_tpl_fdesc_t *fd = _hst_tpl_function_add(name, &found);
-        if (fd == NULL) goto exit;
-        if (!found) {  // if added, then must allocate space for name
-            fd->name = _hst_create_strz(name, i);
-            if (fd->name == NULL) goto exit;
-        }
-        curr = mem_alloc(sizeof(*curr));
-        if (curr == NULL) goto exit;
-        curr->next = NULL;
-        curr->size = 0;
-        curr->fd = fd;
-        *prev = curr;
-        prev = &curr->next;
-    }
 
-    if ( (i=(int)strlen(psz)) ) {
-        curr = mem_alloc(sizeof(*curr));
-        if (curr == NULL) goto exit;
-        curr->next = NULL;
-        curr->text = psz;
-        curr->size = i;
-        *prev = curr;
+// Find value of first element with given name in sorted array.
+static const char *_hst_query_find(hst_query_elt_t **index, int num,
+                                   const char *name) {
+    int lo = 0, hi = num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(index[mid]->name, name) < 0) lo = mid + 1;
+        else hi = mid;
     }
-
-    return first;
-
-exit:
+    if (lo < num && 0 == strcmp(index[lo]->name, name))
+        return index[lo]->value;
     return NULL;
 }
 
 
-int hst_read(hst_req_t **req) {
-    int res, ret = HST_RES_ERR;
+/* Get query elements of request. Query part of request-target is parsed
+ * on first call, it fills 'query_elt_first' list of request.
+ * Names and values are percent-decoded.
+ *
+ * Return:
+ *      ptr to first query element or NULL if query is empty
+ */
+hst_query_elt_t *hst_req_query(hst_req_t *req) {
+    if (req->query_parsed)
+        return req->query_elt_first;
+    req->query_parsed = true;
 
-    if (me.state == STATE_CFG) {
-        me.checkpoint = mem_checkpoint_get();
-        me.state = STATE_READ;
-    } else if (me.state != STATE_READ) {
-        ERROR("Wrong state %d.", me.state);
-        goto exit;
-    }
+    const char *q = strchr(req->request_target, '?');
+    if (q == NULL || !q[1])
+        return NULL;
 
-    if (me.sc != -1) {
-        ERROR("Client socket should be closed.");
-        goto exit;
-    }
+    // names and values are decoded in copy of query
+    char *p = _hst_create_strz(req->mem, q+1, (int)strlen(q+1));
+    if (p == NULL) return NULL;
+    _hst_query_parse(req->mem, p, &req->query_elt_first);
+    return req->query_elt_first;
+}
 
-    // init data
-    memset(me.req, 0, sizeof(*me.req));
-    me.hbuf.len = 0;
-    me.hbuf.sta = 0;
-    me.bbuf.buf = NULL;
-    me.bbuf.tot = 0;
-    me.bbuf.len = 0;
-    me.bbuf.sta = 0;
-    me.body_len = 0;
-    me.body_chunked = 0;
-    mem_checkpoint_restore(me.checkpoint);
-
-    // wait until client connects or timeout expires
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(me.ss, &readfds);
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    res = select(me.ss+1, &readfds, NULL, NULL, &tv);
-    if (res == -1) {
-        ERROR("%s.", strerror(errno));
-        goto exit;
-    }
-    if (res == 0) {
-        ret = HST_RES_CONT;
-        goto exit;
-    }
-    if (!FD_ISSET(me.ss, &readfds)) {
-        ERROR("Unknown error.");
-        goto exit;
-    }
 
-    // get client socket and make it nonblocking
-    me.sc = accept(me.ss, NULL, 0);
-    if (me.sc == -1) {
-        ERROR("%s.", strerror(errno));
-        goto exit;
-    }
-    int yes = 1;
-    res = ioctl(me.sc, FIONBIO, (char *)&yes);
-    if (res == -1) {
-        ERROR("%s.", strerror(errno));
-        goto exit;
+/* Get value of query parameter. Parameters are sorted by name on first
+ * call, so lookup is a binary search.
+ *
+ * Return:
+ *      value of first parameter with given name or NULL if there is none
+ */
+const char *hst_req_query_get(hst_req_t *req, const char *name) {
+    if (req->query_index == NULL) {
+        hst_query_elt_t *e = hst_req_query(req);
+        req->query_index_num = _hst_query_index(req->mem, e,
+                                                &req->query_index);
+        if (req->query_index == NULL) {  // no parameters or no memory
+            for (; e; e = e->next)
+                if (0 == strcmp(e->name, name))
+                    return e->value;
+            return NULL;
+        }
     }
+    return _hst_query_find(req->query_index, req->query_index_num, name);
+}
 
-    // parse headers
-    ret = _hst_parse_headers();
-    if (ret != HST_RES_OK) goto exit;
 
-    // read body
-    if (me.body_len) {  // size is known
-        // allocate body buffer
-        int num = me.body_len;
-        res = buf_alloc(&me.bbuf, num);
-        if (res != HST_RES_OK) goto einternal;
-        // copy from header buffer
-        int n = me.hbuf.len - me.hbuf.sta;
-        if (n > 0) {
-            memcpy(me.bbuf.buf, me.hbuf.buf+me.hbuf.sta, (uint)n);
-            me.bbuf.len += n;
-        }
-        // read from socket
-        for (num-=n; num; num-=res) {
-            res = _hst_buf_add(&me.bbuf, num);
-            if (res < 0) {
-                ret = res;
-                goto exit;
-            } else if (res == 0) {
-                ret = HST_RES_BADREQUEST;
-                goto exit;
-            }
-        }
-    } else if (me.body_chunked) {  // chunked transfer is used
-        // allocate body buffer
-        res = buf_alloc(&me.bbuf, HREAD_SIZE);
-        if (res != HST_RES_OK) goto einternal;
-        // loop through chunks
-        for (;;) {
-            res = _hst_line_get(&me.hbuf);
-            if (res < 0) {
-                goto einternal;
-            } else if (res == 0) {
-                ret = HST_RES_BADREQUEST;
-                goto exit;
-            }
-            // number of bytes in chunk
-            errno = 0;
-            long num = strtol(me.hbuf.buf+me.hbuf.sta, NULL, 10);
-            if (errno || num < 0) {
-                ret = HST_RES_BADREQUEST;
-                goto exit;
-            }
-            // end of chunked transfer
-            if (num == 0) break;
-            // discard line
-            for (;;)
-                if (me.hbuf.buf[me.hbuf.sta++] == '\r')
-                    break;
-            me.hbuf.sta++;
-            // copy from header buffer
-            res = buf_grow(&me.bbuf, (int)num);
-            if (res != HST_RES_OK) goto einternal;
-            int n = me.hbuf.len - me.hbuf.sta;
-            if (n > 0) {
-                memcpy(me.bbuf.buf, me.hbuf.buf+me.hbuf.sta, (uint)n);
-                me.bbuf.len += n;
-                num -= n;
-            }
-            // read from socket
-            while (num) {
-                res = _hst_buf_add(&me.bbuf, (int)num);
-                if (res <= 0) goto exit;
-                num -= res;
-            }
-        }
-    }
-    if (me.bbuf.buf) {
-        int zero = 0;
-        ret = buf_add(&me.bbuf, &zero, 1);
-        if (ret != HST_RES_OK) goto exit;
-        me.req->body = me.bbuf.buf;
-        me.req->body_len = me.bbuf.len - 1;  // zero not included
-    }
+/* Get fields of urlencoded form sent in request body. Body with
+ * 'application/x-www-form-urlencoded' content type is parsed on first
+ * call, it fills 'form_elt_first' list of request. Names and values are
+ * percent-decoded in place in body, so body data is changed.
+ *
+ * Return:
+ *      ptr to first form field or NULL if there are none
+ */
+hst_query_elt_t *hst_req_form(hst_req_t *req) {
+    if (req->form_parsed)
+        return req->form_elt_first;
+    req->form_parsed = true;
+
+    const hst_view_t *v = &req->hdr_known[HST_HDR_CONTENT_TYPE];
+    const char *ct = "application/x-www-form-urlencoded";
+    tok_t tok = {v->ptr, (int)strlen(ct), {0}};
+    if (req->body == NULL || v->ptr == NULL || v->len < tok.len ||
+            0 != tok_cmpi_strz(&tok, ct))
+        return NULL;
 
-    me.state = STATE_WR_RES;
-    *req = me.req;
-    ret = HST_RES_OK;
+    // body is zero-terminated in body buffer
+    _hst_query_parse(req->mem, (char *)req->body, &req->form_elt_first);
+    return req->form_elt_first;
+}
 
-exit:
-    if (ret == HST_RES_INTERNAL) {
-        hst_write_res(500, "Internal server error.");
-        hst_write_end();
-        ret = HST_RES_CONT;
-    } else if (ret == HST_RES_BADREQUEST) {
-        hst_write_res(400, "Bad request");
-        hst_write_end();
-        ret = HST_RES_CONT;
-    }
-    return ret;
 
-einternal:
-    ret = HST_RES_INTERNAL;
-    goto exit;
+/* Get value of form field. Fields are sorted by name on first call, so
+ * lookup is a binary search.
+ *
+ * Return:
+ *      value of first field with given name or NULL if there is none
+ */
+const char *hst_req_form_get(hst_req_t *req, const char *name) {
+    if (req->form_index == NULL) {
+        hst_query_elt_t *e = hst_req_form(req);
+        req->form_index_num = _hst_query_index(req->mem, e,
+                                               &req->form_index);
+        if (req->form_index == NULL) {  // no fields or no memory
+            for (; e; e = e->next)
+                if (0 == strcmp(e->name, name))
+                    return e->value;
+            return NULL;
+        }
+    }
+    return _hst_query_find(req->form_index, req->form_index_num, name);
 }
 
 
-void hst_write_res(int code, const char *text) {
-    if (me.state != STATE_WR_RES) {
-        ERROR("Wrong state %d.", me.state);
+void hst_write_res(hst_ctx_t *ctx, int code, const char *text) {
+    if (ctx->state != STATE_WR_RES) {
+        ERROR("Wrong state %d.", ctx->state);
         goto error;
     }
 
-    // clear headers buffer and print result code
-    me.hbuf.sta = 0;
-    me.hbuf.len = 0;
-    int res = buf_printf(&me.hbuf, "HTTP/1.1 %d %s\r\n", code, text);
+    // print result code after replies to previous requests
+    conn_t *c = ctx->conn;
+    c->res_sta = c->obuf.len;
+    int res = buf_printf(&c->obuf, "HTTP/1.1 %d %s\r\n", code, text);
     if (res != HST_RES_OK) goto error;
+    c->res_no_body = (code < 200 || code == 204 || code == 304);
+    c->res_head = (c->req && c->req->method_head);
 
-    me.state = STATE_WR_HDR;
+    ctx->state = STATE_WR_HDR;
     return;
 
 error:
-    _hst_write_error();
+    _hst_write_error(ctx);
     return;
 }
 
 
-void hst_write_hdr(const char *name, const char *val) {
-    if (me.state != STATE_WR_HDR) {
-        ERROR("Wrong state %d.", me.state);
+void hst_write_hdr(hst_ctx_t *ctx, const char *name, const char *val) {
+    if (ctx->state != STATE_WR_HDR) {
+        ERROR("Wrong state %d.", ctx->state);
         goto error;
     }
 
-    int res = buf_printf(&me.hbuf, "%s: %s\r\n", name, val);
+    int res = buf_printf(&ctx->conn->obuf, "%s: %s\r\n", name, val);
     if (res != HST_RES_OK) goto error;
 
     return;
 
 error:
-    _hst_write_error();
+    _hst_write_error(ctx);
     return;
 }
 
 
-int hst_write_tpl(const hst_tpl_t *tpl) {
-    int res = _hst_write_body_init();
+int hst_write_tpl(hst_ctx_t *ctx, const hst_tpl_t *tpl) {
+    int res = _hst_write_body_init(ctx);
     if (res != HST_RES_OK) goto error;
 
-    if ( (const char *)tpl < (const char *)mem.start ||
-         (const char *)tpl > (const char *)mem.start + me.checkpoint ) {
+    if (!mem_has(&ctx->mem, tpl, ctx->checkpoint)) {
         ERROR("Wrong parameter.");
         goto error;
     }
 
     for (; tpl; tpl=tpl->next) {
         if (tpl->size) {  // html text
-            hst_write_body_data(tpl->text, tpl->size);
+            hst_write_body_data(ctx, tpl->text, tpl->size);
         } else {  // template function
             hst_tpl_func_t func = tpl->fd->func;
             if (func)
-                func();
+                func(ctx);
             else {
-                hst_write_body_printf("<span>undefined template function: "
+                hst_write_body_printf(ctx, "<span>undefined template function: "
                                       "'%s'</span>", tpl->fd->name);
             }
         }
     }
 
-    return hst_write_end();
+    return hst_write_end(ctx);
 
 error:
-    _hst_write_error();
+    _hst_write_error(ctx);
     return HST_RES_ERR;
 }
 
 
-void hst_write_body_data(const void *ptr, int size) {
+void hst_write_body_data(hst_ctx_t *ctx, const void *ptr, int size) {
     int res;
 
-    res = _hst_write_body_init();
+    res = _hst_write_body_init(ctx);
     if (res != HST_RES_OK) goto error;
 
-    if (me.state == STATE_WR_BODY) {
-        res = buf_add(&me.bbuf, ptr, size);
-        if (res != HST_RES_OK) {
-            res = _hst_write_body_begin_chunked();
+    buf_t *bbuf = &ctx->conn->bbuf;
+
+    if (ctx->state == STATE_WR_BODY) {
+        // body, which does not fit in memory of connection, is sent in chunks
+        int free = bbuf->tot - bbuf->len;
+        if (size > free && HST_RES_OK != buf_try_grow(bbuf, size-free)) {
+            res = _hst_write_body_begin_chunked(ctx);
             if (res != HST_RES_OK) goto error;
             goto chunked;
         }
+        buf_add(bbuf, ptr, size);
         return;
     }
 
 chunked:
-    if (me.state == STATE_WR_BODY_CHUNKED) {
-        while (size) {
-            // write data to body
-            int free = CHUNK_SIZE - me.bbuf.len;
-            if (free > size) free = size;
-            memcpy(me.bbuf.buf+me.bbuf.len, ptr, (uint)free);
-            me.bbuf.len += free;
-            ptr = (const char*)ptr + free;
-            size -= free;
-
-            // write chunk to client socket
-            if (me.bbuf.len >= CHUNK_SIZE) {
-                res = _hst_write_chunk(me.bbuf.buf, CHUNK_SIZE);
-                if (res != HST_RES_OK) goto error;
-                me.bbuf.sta = CHUNK_SIZE;
-                buf_shift(&me.bbuf);
-            }
-        }
+    if (ctx->state == STATE_WR_BODY_CHUNKED) {
+        res = _hst_write_chunk(ctx, ptr, size);
+        if (res != HST_RES_OK) goto error;
         return;
     }
 
 error:
-    _hst_write_error();
+    _hst_write_error(ctx);
     return;
 }
 
 
-void hst_write_body_print(const char *strz) {
-    hst_write_body_data(strz, (int)strlen(strz));
+void hst_write_body_print(hst_ctx_t *ctx, const char *strz) {
+    hst_write_body_data(ctx, strz, (int)strlen(strz));
 }
 
 
-void hst_write_body_printf(const char *format, ...) {
+void hst_write_body_printf(hst_ctx_t *ctx, const char *format, ...) {
     char buf[CHUNK_SIZE];
 
     va_list v;
@@ -1221,58 +4826,142 @@ void hst_write_body_printf(const char *format, ...) {
         ERROR("String too big.");
         goto error;
     }
-    hst_write_body_data(buf, res);
+    hst_write_body_data(ctx, buf, res);
+    return;
+
+error:
+    _hst_write_error(ctx);
+    return;
+}
+
+
+/* Send reply body from file descriptor without copying it to user space.
+ * Must be called instead of other body functions. Data is sent with
+ * sendfile() or, for pipes, splice() after hst_write_end() is called.
+ * Library owns descriptor and closes it when body is sent or on errors.
+ *
+ * Input:
+ *      fd - file or pipe descriptor
+ *      offset - file offset of body, ignored for pipes
+ *      length - body length, -1 for rest of file
+ */
+void hst_write_body_fd(hst_ctx_t *ctx, int fd, off_t offset, off_t length) {
+    conn_t *c = ctx->conn;
+
+    if (ctx->state != STATE_WR_HDR) {
+        ERROR("Wrong state %d.", ctx->state);
+        goto error;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        ERROR("%s.", strerror(errno));
+        goto error;
+    }
+    c->out_pipe = S_ISFIFO(st.st_mode);
+    if (length < 0) {
+        if (c->out_pipe || offset > st.st_size) {
+            ERROR("Unknown body length.");
+            goto error;
+        }
+        length = st.st_size - offset;
+    }
+
+    // add connection and content-length headers and blank line
+    int res = _hst_write_hdr_connection(ctx);
+    if (res != HST_RES_OK) goto error;
+    res = buf_printf(&c->obuf, "Content-Length: %lld\r\n\r\n",
+                     (long long)length);
+    if (res != HST_RES_OK) goto error;
+
+    // reply to HEAD has only headers
+    if (c->res_head) {
+        close(fd);
+        fd = -1;
+    }
+
+    c->out_fd = fd;
+    c->out_off = offset;
+    c->out_len = length;
+    ctx->state = STATE_WR_BODY_FD;
     return;
 
 error:
-    _hst_write_error();
+    close(fd);
+    _hst_write_error(ctx);
     return;
 }
 
 
-int hst_write_end(void) {
+int hst_write_end(hst_ctx_t *ctx) {
     int ret = HST_RES_ERR;
+    conn_t *c = ctx->conn;
 
-    if (me.state == STATE_WR_ERROR)
+    if (ctx->state == STATE_WR_ERROR)
         goto exit;
 
-    if (me.state == STATE_WR_HDR) {
-        // add blank line to headers
-        ret = buf_printf(&me.hbuf, "\r\n");
+    if (ctx->state == STATE_WR_HDR) {
+        // add connection header, empty body length unless status code
+        // implies it, and blank line
+        ret = _hst_write_hdr_connection(ctx);
+        if (ret != HST_RES_OK) goto exit;
+        ret = buf_printf(&c->obuf, c->res_no_body ? "\r\n" :
+                         "Content-Length: 0\r\n\r\n");
         if (ret != HST_RES_OK) goto exit;
 
-        // send headers
-        ret = _hst_write(me.hbuf.buf, me.hbuf.len);
+        ret = _hst_conn_next(ctx, c);
+        c = NULL;
         goto exit;
     }
 
-    if (me.state == STATE_WR_BODY) {
-        // add content-length header and blank line
-        ret = buf_printf(&me.hbuf, "Content-Length: %d\r\n\r\n", me.bbuf.len);
+    if (ctx->state == STATE_WR_BODY) {
+        // add connection and content-length headers and blank line
+        ret = _hst_write_hdr_connection(ctx);
         if (ret != HST_RES_OK) goto exit;
-
-        // send headers
-        ret = _hst_write(me.hbuf.buf, me.hbuf.len);
+        ret = buf_printf(&c->obuf, "Content-Length: %d\r\n\r\n", c->bbuf.len);
         if (ret != HST_RES_OK) goto exit;
 
-        // send body
-        ret = _hst_write(me.bbuf.buf, me.bbuf.len);
+        // reply to HEAD has only headers
+        if (c->res_head)
+            c->bbuf.len = 0;
+
+        // small body is copied to output buffer to be sent with headers,
+        // other one is sent from body buffer
+        if (c->bbuf.len <= c->obuf.tot - c->obuf.len) {
+            memcpy(c->obuf.buf+c->obuf.len, c->bbuf.buf, (size_t)c->bbuf.len);
+            c->obuf.len += c->bbuf.len;
+        } else {
+            c->out_body = true;
+        }
+
+        ret = _hst_conn_next(ctx, c);
+        c = NULL;
         goto exit;
     }
 
-    if (me.state == STATE_WR_BODY_CHUNKED) {
-        ret = _hst_write_chunk(me.bbuf.buf, me.bbuf.len);
+    if (ctx->state == STATE_WR_BODY_FD) {
+        ret = _hst_conn_next(ctx, c);
+        c = NULL;
         goto exit;
     }
 
-    ERROR("Wrong state %d.", me.state);
+    if (ctx->state == STATE_WR_BODY_CHUNKED) {
+        ret = _hst_write_chunk_end(ctx);
+        if (ret != HST_RES_OK) goto exit;
 
-exit:
-    if (me.sc != -1) {
-        shutdown(me.sc, SHUT_RDWR);
-        close(me.sc);
-        me.sc = -1;
+        ret = _hst_conn_next(ctx, c);
+        c = NULL;
+        goto exit;
     }
-    me.state = STATE_READ;
+
+    ERROR("Wrong state %d.", ctx->state);
+
+exit:
+    // connection is closed unless reply is being sent
+    if (c && c->state != CONN_FREE)
+        _hst_conn_close(ctx, c);
+    ctx->conn = NULL;
+    ctx->req = NULL;
+    ctx->state = STATE_READ;
     return ret;
 }
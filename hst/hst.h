@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <netinet/in.h>
+#include <sys/types.h>
 
 
 /* Result codes returned by library functions.
@@ -23,14 +24,48 @@
 
 
 // Library configuration parameters.
+// If any of 'mem_*' flags is set, memory for 'mem_total' and first block of
+// each connection is mapped by hst_init() at once, other memory is taken
+// from system on demand. Huge pages are used if they are reserved in
+// system, else transparent huge pages are requested.
+// With 'body_stream' option body is read with hst_read_body() as it arrives.
+// If there is no data, request is handed to application by hst_read() again
+// when it arrives; whole body must arrive within 'body_timeout' seconds.
+// Reply body, which does not fit in connection memory, is sent in chunks
+// as far as client reads them without waiting, rest of them is queued;
+// reply fails if client is too slow and connection memory is exhausted.
+// Big files are better sent with hst_write_body_fd().
+// Reply to HEAD request is written as usual, its body is not sent.
 typedef struct _hst_conf_t {
     int backlog;            // backlog parameter for listen()
     in_addr_t addr;         // addr to listen on
     in_port_t port;         // port to listen on
     int mem_total;          // amount of memory to be used by library
+    int max_conns;          // max number of simultaneous client connections
+    int conn_mem;           // max memory for each client connection
+    int keepalive_timeout;  // seconds idle persistent connection is kept open
+    int header_timeout;     // seconds to read request headers
+    int body_timeout;       // seconds to read request body
+    int write_timeout;      // seconds reply write may make no progress
+    int defer_timeout;      // seconds reply may stay deferred
+    int keepalive_max;      // max requests per connection, 1 disables keep-alive
+    int workers;            // number of worker threads started by hst_run()
+    bool reuse_port;        // set SO_REUSEPORT option on listening socket
+    bool cpu_pin;           // pin each worker thread to its own cpu
+    bool io_uring;          // use io_uring if kernel supports it, else epoll
+    bool req_views;         // give header and path views instead of lists
+    bool body_stream;       // request body is read with hst_read_body()
+    bool mem_huge_pages;    // map memory with huge pages
+    bool mem_populate;      // prefault memory at init
+    bool mem_lock;          // lock memory, it is never swapped out
 } hst_conf_t;
 
 
+// Library instance. All library functions operate on instance passed to
+// them, so instances may be used by different threads independently.
+typedef struct _hst_ctx_t hst_ctx_t;
+
+
 // Http header.
 typedef struct _hst_hdr_t hst_hdr_t;
 struct _hst_hdr_t {
@@ -40,6 +75,48 @@ struct _hst_hdr_t {
 };
 
 
+// View of string in request data. It is not zero-terminated.
+typedef struct _hst_view_t {
+    const char *ptr;
+    int len;
+    char padding[4];
+} hst_view_t;
+
+
+// Well-known http headers. Values of them are kept in request slots.
+typedef enum _hst_hdr_id_t {
+    HST_HDR_OTHER,
+    HST_HDR_ACCEPT,
+    HST_HDR_ACCEPT_ENCODING,
+    HST_HDR_ACCEPT_LANGUAGE,
+    HST_HDR_AUTHORIZATION,
+    HST_HDR_CACHE_CONTROL,
+    HST_HDR_CONNECTION,
+    HST_HDR_CONTENT_LENGTH,
+    HST_HDR_CONTENT_TYPE,
+    HST_HDR_COOKIE,
+    HST_HDR_EXPECT,
+    HST_HDR_HOST,
+    HST_HDR_IF_MODIFIED_SINCE,
+    HST_HDR_IF_NONE_MATCH,
+    HST_HDR_ORIGIN,
+    HST_HDR_RANGE,
+    HST_HDR_REFERER,
+    HST_HDR_TRANSFER_ENCODING,
+    HST_HDR_UPGRADE,
+    HST_HDR_USER_AGENT,
+    HST_HDR_X_FORWARDED_FOR,
+    HST_HDR_NUM
+} hst_hdr_id_t;
+
+
+// View of http header.
+typedef struct _hst_hdr_view_t {
+    hst_view_t name;
+    hst_view_t value;
+} hst_hdr_view_t;
+
+
 // Elements of request`s path parsed as list of names.
 typedef struct _hst_path_elt_t hst_path_elt_t;
 struct _hst_path_elt_t {
@@ -62,16 +139,59 @@ typedef struct _hst_tpl_elt_t hst_tpl_t;
 
 
 // Template function.
-typedef void(*hst_tpl_func_t)(void);
+typedef void(*hst_tpl_func_t)(hst_ctx_t *ctx);
+
+
+// Methods of request for hst_route().
+#define HST_METHOD_GET      (1 << 0)
+#define HST_METHOD_POST     (1 << 1)
+#define HST_METHOD_HEAD     (1 << 2)
+#define HST_METHOD_ANY      (HST_METHOD_GET | HST_METHOD_POST | HST_METHOD_HEAD)
+
+
+// Worker thread function for hst_run(). Function runs on its own library
+// instance; 'idx' is worker number starting from 0. Function should return
+// when hst_read() fails, it happens when other worker could not start.
+typedef void(*hst_worker_func_t)(hst_ctx_t *ctx, int idx, void *arg);
+
+
+// Part of multipart/form-data request body.
+typedef struct _hst_part_t {
+    const char *name;           // field name, NULL if not given
+    const char *filename;       // file name, NULL if not given
+    const char *content_type;   // content type, NULL if not given
+    int idx;                    // part number starting from 0
+    char padding[4];
+} hst_part_t;
+
+
+// Function receiving content of multipart body part in pieces, 'last' is
+// set for last piece of part. It returns HST_RES_OK to continue parsing.
+typedef int(*hst_part_func_t)(hst_ctx_t *ctx, const hst_part_t *part,
+                              const char *ptr, int len, bool last, void *arg);
+
 
+// Path parameter captured by route. Value is not zero-terminated.
+typedef struct _hst_param_t {
+    const char *name;
+    hst_view_t value;
+} hst_param_t;
+
+
+// Handle of request which reply is deferred.
+typedef struct _hst_defer_t hst_defer_t;
 
-// Request object.
+
+// Request object. It stays valid until reply is finished by hst_write_end().
+// Deferred request stays valid until hst_req_resume() is called for it.
 typedef struct {
     // request method used by client
     bool method_get;
     bool method_post;
     bool method_head;
-    char padding1[5];
+    bool query_parsed;  // query_elt_first is filled by hst_req_query()
+    bool form_parsed;   // form_elt_first is filled by hst_req_form()
+    char padding1[3];
 
     // request-target from request line (path[?query] part from URL)
     const char *request_target;
@@ -82,32 +202,96 @@ typedef struct {
     // ptr to first path element
     hst_path_elt_t *path_elt_first;
 
-    // ptr to first query element
+    // arrays of header and path views, they are set instead of lists above
+    // if 'req_views' option is used
+    hst_hdr_view_t *hdr_views;
+    hst_view_t *path_views;
+    int hdr_views_num;
+    int path_views_num;
+
+    // values of well-known headers indexed by hst_hdr_id_t, values are
+    // zero-terminated unless 'req_views' option is used
+    hst_view_t hdr_known[HST_HDR_NUM];
+
+    // ptr to first query element, it is filled on demand by hst_req_query()
     hst_query_elt_t *query_elt_first;
 
-    // request body
+    // ptr to first field of urlencoded form from body, it is filled on
+    // demand by hst_req_form()
+    hst_query_elt_t *form_elt_first;
+
+    // query elements and form fields sorted by name, set by
+    // hst_req_query_get() and hst_req_form_get()
+    hst_query_elt_t **query_index;
+    hst_query_elt_t **form_index;
+    int query_index_num;
+    int form_index_num;
+
+    // path parameters captured by route matched with hst_route_dispatch()
+    hst_param_t *params;
+    int params_num;
+    char padding2[4];
+
+    // request body, it is not set if 'body_stream' option is used
     const char *body;   // ptr to body as zero-terminated string
     int body_len;       // body length
 
     // result
     int res_code;
     char *res_text;
+
+    // application data, it is kept when request is handed to application
+    // again for more data of streamed body
+    void *udata;
+
+    // memory for objects created on demand, used by library
+    void *mem;
 } hst_req_t;
 
 
-int hst_init(hst_conf_t *conf);
-void hst_deinit(void);
+// Request handler of route, called by hst_route_dispatch().
+typedef void(*hst_route_func_t)(hst_ctx_t *ctx, hst_req_t *req, void *arg);
+
+
+hst_ctx_t *hst_init(hst_conf_t *conf);
+void hst_deinit(hst_ctx_t *ctx);
+
+int hst_run(hst_conf_t *conf, hst_worker_func_t func, void *arg);
+
+void hst_udata_set(hst_ctx_t *ctx, void *udata);
+void *hst_udata_get(hst_ctx_t *ctx);
+
+int hst_tpl_function(hst_ctx_t *ctx, const char *name, hst_tpl_func_t func);
+hst_tpl_t *hst_tpl_compile(hst_ctx_t *ctx, const char *psz);
+
+int hst_route(hst_ctx_t *ctx, int methods, const char *pattern,
+              hst_route_func_t func, void *arg);
+int hst_route_dispatch(hst_ctx_t *ctx, hst_req_t *req);
 
-int hst_tpl_function(const char *name, hst_tpl_func_t func);
-hst_tpl_t *hst_tpl_compile(const char *psz);
+int hst_read(hst_ctx_t *ctx, hst_req_t **req);
+hst_defer_t *hst_req_defer(hst_ctx_t *ctx);
+int hst_req_resume(hst_ctx_t *ctx, hst_defer_t *d, hst_req_t **req);
+void hst_wake(hst_ctx_t *ctx);
+int hst_read_body(hst_ctx_t *ctx, void *ptr, int max);
+int hst_read_multipart(hst_ctx_t *ctx, hst_part_func_t func, void *arg);
 
-int hst_read(hst_req_t **req);
+int hst_req_hdr_count(const hst_req_t *req);
+const hst_hdr_view_t *hst_req_hdr_at(const hst_req_t *req, int i);
+int hst_req_path_count(const hst_req_t *req);
+const hst_view_t *hst_req_path_at(const hst_req_t *req, int i);
+const hst_view_t *hst_req_hdr_get(const hst_req_t *req, hst_hdr_id_t id);
+hst_query_elt_t *hst_req_query(hst_req_t *req);
+const char *hst_req_query_get(hst_req_t *req, const char *name);
+hst_query_elt_t *hst_req_form(hst_req_t *req);
+const char *hst_req_form_get(hst_req_t *req, const char *name);
+const hst_view_t *hst_req_param(const hst_req_t *req, const char *name);
 
-void hst_write_res(int code, const char *text);
-void hst_write_hdr(const char *name, const char *val);
-int hst_write_tpl(const hst_tpl_t *tpl);
+void hst_write_res(hst_ctx_t *ctx, int code, const char *text);
+void hst_write_hdr(hst_ctx_t *ctx, const char *name, const char *val);
+int hst_write_tpl(hst_ctx_t *ctx, const hst_tpl_t *tpl);
 
-void hst_write_body_data(const void *ptr, int size);
-void hst_write_body_print(const char *strz);
-void hst_write_body_printf(const char *format, ...);
-int hst_write_end(void);
+void hst_write_body_data(hst_ctx_t *ctx, const void *ptr, int size);
+void hst_write_body_print(hst_ctx_t *ctx, const char *strz);
+void hst_write_body_printf(hst_ctx_t *ctx, const char *format, ...);
+void hst_write_body_fd(hst_ctx_t *ctx, int fd, off_t offset, off_t length);
+int hst_write_end(hst_ctx_t *ctx);